@@ -0,0 +1,165 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <scoped_allocator>
+#include <set>
+#include <vector>
+
+#define ARENA_CHUNK_SIZE (0x10000)
+
+// Freed allocations up to ARENA_FREE_CLASSES * ARENA_FREE_STEP bytes are
+// kept for reuse, rounded up to a multiple of ARENA_FREE_STEP
+#define ARENA_FREE_STEP (16)
+#define ARENA_FREE_CLASSES (16)
+
+// Bump allocator for a cluster's analysis state. Freed nodes go on a free
+// list for their size and get handed back out before anything new is
+// bumped, chunks all go at once when the arena is destroyed.
+class Arena
+{
+private:
+    std::mutex lock;
+    std::vector<void*> chunks;
+    char* cur = nullptr;
+    size_t left = 0;
+    
+    // Each free node holds the next one in its first bytes
+    void* free_lists[ARENA_FREE_CLASSES] = {};
+    
+    static size_t size_class(size_t size, size_t align)
+    {
+        if (!size || align > ARENA_FREE_STEP) return ARENA_FREE_CLASSES;
+
+        return (size - 1) / ARENA_FREE_STEP;
+    }
+
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        for (void* chunk : chunks)
+            free(chunk);
+    }
+
+    void* allocate(size_t size, size_t align)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        
+        size_t cls = size_class(size, align);
+        if (cls < ARENA_FREE_CLASSES && free_lists[cls])
+        {
+            void* out = free_lists[cls];
+            free_lists[cls] = *(void**)out;
+
+            allocs++;
+            bytes += size;
+            return out;
+        }
+        
+        // Anything that might be reused gets the full size of its class
+        if (cls < ARENA_FREE_CLASSES)
+        {
+            size = (cls + 1) * ARENA_FREE_STEP;
+            align = ARENA_FREE_STEP;
+        }
+
+        size_t pad = (align - ((uintptr_t)cur % align)) % align;
+        if (!cur || pad + size > left)
+        {
+            size_t chunk_size = size + align > ARENA_CHUNK_SIZE ? size + align : ARENA_CHUNK_SIZE;
+            cur = (char*)malloc(chunk_size);
+            left = chunk_size;
+            chunks.push_back(cur);
+            pad = (align - ((uintptr_t)cur % align)) % align;
+        }
+
+        void* out = cur + pad;
+        cur += pad + size;
+        left -= pad + size;
+
+        allocs++;
+        bytes += size;
+        return out;
+    }
+    
+    void deallocate(void* ptr, size_t size, size_t align)
+    {
+        size_t cls = size_class(size, align);
+        if (!ptr || cls >= ARENA_FREE_CLASSES) return;
+
+        std::lock_guard<std::mutex> guard(lock);
+        *(void**)ptr = free_lists[cls];
+        free_lists[cls] = ptr;
+    }
+
+    uint64_t get_allocs()
+    {
+        return allocs;
+    }
+
+    uint64_t get_bytes()
+    {
+        return bytes;
+    }
+
+    size_t get_chunks()
+    {
+        return chunks.size();
+    }
+};
+
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* arena) : arena(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        return (T*)arena->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        arena->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const
+    {
+        return arena == other.arena;
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const
+    {
+        return arena != other.arena;
+    }
+};
+
+// Maps hand their arena down to containers stored in them
+template <typename K, typename V, typename C = std::less<K> >
+using ArenaMap = std::map<K, V, C, std::scoped_allocator_adaptor<ArenaAllocator<std::pair<const K, V> > > >;
+
+template <typename T, typename C = std::less<T> >
+using ArenaSet = std::set<T, C, ArenaAllocator<T> >;
+
+#endif // ARENA_H
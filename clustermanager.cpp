@@ -4,53 +4,265 @@
 #include <algorithm>
 #include <cstring>
 #include <atomic>
+#include <sys/mman.h>
+#include <unistd.h>
 
-int cluster_id_cnt = 0;
+std::atomic<int> cluster_id_cnt = 0;
 
-void ClusterManager::remove_matching_tokens(uint64_t addr, std::string str)
+// NRO followed by IMPORTS, as the base cluster left them
+static int image_fd = -1;
+
+bool image_share(void* nro_mem, void* import_mem)
 {
-    for (auto& pair : tokens)
+    int fd = memfd_create("nro_image", MFD_CLOEXEC);
+    if (fd < 0)
     {
-        std::vector<L2C_Token> to_erase;
-        for (auto& t : pair.second)
+        printf_warn("Failed to create shared NRO image, clusters will copy it instead\n");
+        return false;
+    }
+    
+    if (ftruncate(fd, NRO_SIZE + IMPORTS_SIZE)
+        || pwrite(fd, nro_mem, NRO_SIZE, 0) != NRO_SIZE
+        || pwrite(fd, import_mem, IMPORTS_SIZE, NRO_SIZE) != IMPORTS_SIZE)
+    {
+        printf_warn("Failed to write shared NRO image, clusters will copy it instead\n");
+        close(fd);
+        return false;
+    }
+    
+    image_fd = fd;
+    return true;
+}
+
+bool image_is_shared()
+{
+    return image_fd >= 0;
+}
+
+// Fills mem (or new memory if null) with part of the image. Mapping the shared
+// image over the same address again drops whatever the guest wrote there.
+void* image_copy(void* mem, uint64_t offset, uint64_t size, void* src, bool mapped)
+{
+    if (mapped)
+    {
+        void* out = mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (mem ? MAP_FIXED : 0), image_fd, offset);
+        if (out == MAP_FAILED)
         {
-            if (t.pc == addr && t.str == str)
-            {
-                to_erase.push_back(t);
-            }
+            printf_error("Failed to map shared NRO image at offset %" PRIx64 "\n", offset);
+            return nullptr;
         }
+        return out;
+    }
+    
+    if (!mem)
+        mem = malloc(size);
+    memcpy(mem, src, size);
+    return mem;
+}
 
-        for (auto& t : to_erase)
+void image_release(void* mem, uint64_t size, bool mapped)
+{
+    if (!mem) return;
+
+    if (mapped)
+        munmap(mem, size);
+    else
+        free(mem);
+}
+
+// A block's tokens all share a generation, since every insert goes
+// through live_tokens and sweeps any stale ones out first
+bool ClusterManager::tokens_stale(uint64_t block)
+{
+    auto block_tokens = tokens.find(block);
+    if (block_tokens == tokens.end() || block_tokens->second.empty()) return false;
+
+    return block_tokens->second.begin()->gen != block_gen(block);
+}
+
+// Reclaims whatever an invalidation left behind for this block
+void ClusterManager::sweep_block(uint64_t block)
+{
+    if (tokens_stale(block))
+    {
+        for (auto& t : tokens[block])
         {
-            pair.second.erase(t);
+            converge_points.reset(t.pc);
+            fork_origins.reset(t.pc);
         }
+        clear_block_tokens(block);
+    }
+
+    auto iter = blocks.find(block);
+    if (iter != blocks.end() && iter->second.gen != block_gen(block))
+        set_block(block, L2C_CodeBlock());
+}
+
+void ClusterManager::sweep_tokens_at(uint64_t pc)
+{
+    auto iter = token_blocks.find(pc);
+    if (iter == token_blocks.end()) return;
+
+    std::vector<uint64_t> stale;
+    for (uint64_t block : iter->second)
+    {
+        if (tokens_stale(block))
+            stale.push_back(block);
+    }
+
+    for (uint64_t block : stale)
+    {
+        sweep_block(block);
+    }
+}
+
+void ClusterManager::sweep_stale()
+{
+    if (stale_blocks.empty()) return;
+
+    for (uint64_t block : stale_blocks)
+    {
+        sweep_block(block);
+    }
+    printf_verbose("Cluster %u: Swept %zu stale block(s)\n", id, stale_blocks.size());
+    stale_blocks.clear();
+}
+
+L2C_TokenSet& ClusterManager::live_tokens(uint64_t block)
+{
+    if (tokens_stale(block))
+        sweep_block(block);
+
+    return tokens[block];
+}
+
+L2C_CodeBlock& ClusterManager::live_block(uint64_t addr)
+{
+    L2C_CodeBlock* block = find_live_block(addr);
+    if (block) return *block;
+
+    set_block(addr, L2C_CodeBlock());
+    return blocks[addr];
+}
+
+L2C_CodeBlock* ClusterManager::find_live_block(uint64_t addr)
+{
+    auto iter = blocks.find(addr);
+    if (iter == blocks.end()) return nullptr;
+
+    if (iter->second.gen != block_gen(addr))
+    {
+        sweep_block(addr);
+        iter = blocks.find(addr);
+    }
+
+    return &iter->second;
+}
+
+// Tokens are ordered by pc first, so a block's tokens at one pc are adjacent
+std::pair<L2C_TokenSet::iterator, L2C_TokenSet::iterator> ClusterManager::block_tokens_at(uint64_t block, uint64_t pc)
+{
+    L2C_Token key;
+    auto& block_tokens = live_tokens(block);
+    
+    key.pc = pc;
+    auto start = block_tokens.lower_bound(key);
+    key.pc = pc + 1;
+    auto end = block_tokens.lower_bound(key);
+
+    return std::make_pair(start, end);
+}
+
+void ClusterManager::insert_token(uint64_t block, const L2C_Token& token)
+{
+    auto inserted = live_tokens(block).insert(token);
+    if (!inserted.second) return;
+    inserted.first->gen = block_gen(block);
+    token_blocks[token.pc].insert(block);
+
+    if (token.is_edge())
+        block_succs[block][token.args[0]]++;
+    graph_frozen = false;
+}
+
+void ClusterManager::erase_token(uint64_t block, L2C_Token token)
+{
+    if (!live_tokens(block).erase(token)) return;
+    graph_frozen = false;
+
+    if (token.is_edge())
+    {
+        auto& succs = block_succs[block];
+        auto succ = succs.find(token.args[0]);
+        if (succ != succs.end() && !--succ->second)
+            succs.erase(succ);
     }
+
+    auto range = block_tokens_at(block, token.pc);
+    if (range.first != range.second) return;
+    
+    auto iter = token_blocks.find(token.pc);
+    if (iter == token_blocks.end()) return;
+
+    iter->second.erase(block);
+    if (!iter->second.size())
+        token_blocks.erase(iter);
 }
 
-void ClusterManager::remove_block_matching_tokens(uint64_t block, uint64_t addr, std::string str)
+void ClusterManager::clear_block_tokens(uint64_t block)
+{
+    auto block_tokens = tokens.find(block);
+    if (block_tokens == tokens.end()) return;
+
+    for (auto& t : block_tokens->second)
+    {
+        auto iter = token_blocks.find(t.pc);
+        if (iter == token_blocks.end()) continue;
+
+        iter->second.erase(block);
+        if (!iter->second.size())
+            token_blocks.erase(iter);
+    }
+    
+    block_tokens->second.clear();
+    block_succs.erase(block);
+    graph_frozen = false;
+}
+
+void ClusterManager::remove_matching_tokens(uint64_t addr, uint32_t sym)
+{
+    for (uint64_t block : token_blocks_at(addr))
+    {
+        remove_block_matching_tokens(block, addr, sym);
+    }
+}
+
+void ClusterManager::remove_block_matching_tokens(uint64_t block, uint64_t addr, uint32_t sym)
 {
     std::vector<L2C_Token> to_erase;
-    for (auto& t : tokens[block])
+    auto range = block_tokens_at(block, addr);
+    for (auto iter = range.first; iter != range.second; iter++)
     {
-        if (t.pc == addr && t.str == str)
+        if (iter->sym == sym)
         {
-            to_erase.push_back(t);
+            to_erase.push_back(*iter);
         }
     }
 
     for (auto& t : to_erase)
     {
-        tokens[block].erase(t);
+        erase_token(block, t);
     }
 }
 
-bool ClusterManager::token_by_addr_and_name_exists(uint64_t pc, std::string str)
+bool ClusterManager::token_by_addr_and_name_exists(uint64_t pc, uint32_t sym)
 {
-    for (auto& pair : tokens)
+    for (uint64_t block : token_blocks_at(pc))
     {
-        for (auto& t : pair.second)
+        auto range = block_tokens_at(block, pc);
+        for (auto iter = range.first; iter != range.second; iter++)
         {
-            if (t.pc == pc && t.str == str)
+            if (iter->sym == sym)
             {
                 return true;
             }
@@ -62,20 +274,22 @@ bool ClusterManager::token_by_addr_and_name_exists(uint64_t pc, std::string str)
 
 void ClusterManager::add_token_by_prio(uint64_t block, L2C_Token token)
 {
-    for (auto& pair : tokens)
+    for (uint64_t other : token_blocks_at(token.pc))
     {
         std::set<L2C_Token> to_erase;
-        for (auto& t : pair.second)
+        auto range = block_tokens_at(other, token.pc);
+        for (auto iter = range.first; iter != range.second; iter++)
         {
-            if (t.pc == token.pc && t.str == token.str && token.fork_hierarchy.size() < t.fork_hierarchy.size())
+            auto& t = *iter;
+            if (t.sym == token.sym && token.fork_hierarchy.size() < t.fork_hierarchy.size())
             {
                 to_erase.insert(t);
             }
-            else if (t.pc == token.pc && t.str == token.str && token.fork_hierarchy.size() == t.fork_hierarchy.size() && t.fork_hierarchy[0] > token.fork_hierarchy[0])
+            else if (t.sym == token.sym && token.fork_hierarchy.size() == t.fork_hierarchy.size() && t.fork_hierarchy[0] > token.fork_hierarchy[0])
             {
                 to_erase.insert(t);
             }
-            else if (t.pc == token.pc && t.str == token.str && token.fork_hierarchy.size() > t.fork_hierarchy.size())
+            else if (t.sym == token.sym && token.fork_hierarchy.size() > t.fork_hierarchy.size())
             {
                 return;
             }
@@ -83,23 +297,23 @@ void ClusterManager::add_token_by_prio(uint64_t block, L2C_Token token)
 
         for (auto& t : to_erase)
         {
-            pair.second.erase(t);
+            erase_token(other, t);
         }
     }
 
     //printf("%llx\n", block);
     //token.print();
 
-    tokens[block].insert(token);
+    insert_token(block, token);
 }
 
 void ClusterManager::add_subreplace_token(EmuInstance* inst, uint64_t block, L2C_Token token)
 {
     std::set<L2C_Token> to_erase;
-    for (auto& t : tokens[block])
+    for (auto& t : live_tokens(block))
     {
-        if ((t.pc == token.pc && t.str == "SUB_BRANCH") 
-            || (t.str == "SUB_GOTO" && t.args[0] == inst->get_current_block()))
+        if ((t.pc == token.pc && t.sym == L2C_TokenSym_SubBranch) 
+            || (t.sym == L2C_TokenSym_SubGoto && t.args[0] == inst->get_current_block()))
         {
             to_erase.insert(t);
         }
@@ -108,9 +322,9 @@ void ClusterManager::add_subreplace_token(EmuInstance* inst, uint64_t block, L2C
     bool function_tail = false;
     for (auto& t : to_erase)
     {
-        tokens[block].erase(t);
+        erase_token(block, t);
         
-        if (t.str == "SUB_GOTO")
+        if (t.sym == L2C_TokenSym_SubGoto)
             function_tail = true;
     }
 
@@ -118,7 +332,7 @@ void ClusterManager::add_subreplace_token(EmuInstance* inst, uint64_t block, L2C
     
     if (function_tail)
     {
-        token.str = "SUB_RET";
+        token.sym = L2C_TokenSym_SubRet;
         token.type = L2C_TokenType_Meta;
         token.args.clear();
         token.fargs.clear();
@@ -126,29 +340,57 @@ void ClusterManager::add_subreplace_token(EmuInstance* inst, uint64_t block, L2C
         
         inst->pop_block();
         
-        if (token.pc+4 >= blocks[block].addr_end)
-            blocks[block].addr_end = token.pc+4;
+        if (token.pc+4 >= live_block(block).addr_end)
+            set_block_end(block, token.pc+4);
     }
 }
 
-uint64_t ClusterManager::find_containing_block(uint64_t addr)
+void ClusterManager::set_block(uint64_t addr, const L2C_CodeBlock& block)
 {
-    for (auto& block_pair : blocks)
-    {
-        auto& block = block_pair.second;
+    auto& dest = blocks[addr];
+    dest = block;
+    dest.gen = block_gen(addr);
+    
+    if (block.addr == addr && block.addr_end > addr)
+        set_block_end(addr, block.addr_end);
+    else
+        block_ranges.erase(addr);
+}
 
-        if (addr >= block.addr && addr < block.addr_end)
-        {
-            return block.addr;
-        }
-    }
+void ClusterManager::set_block_end(uint64_t addr, uint64_t addr_end)
+{
+    auto& block = live_block(addr);
+    block.addr_end = addr_end;
     
-    return 0;
+    if (!block.addr || block.addr != addr || addr_end <= addr)
+    {
+        block_ranges.erase(addr);
+        return;
+    }
+
+    block_ranges.set(addr, addr_end);
+}
+
+uint64_t ClusterManager::lowest_block_containing(uint64_t addr, bool exclude_start)
+{
+    return block_ranges.lowest_containing(addr, exclude_start);
 }
 
+uint64_t ClusterManager::find_containing_block(uint64_t addr)
+{
+    return lowest_block_containing(addr, false);
+}
+
+uint64_t ClusterManager::find_overlapping_block(uint64_t addr)
+{
+    return lowest_block_containing(addr, true);
+}
 
 void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
 {
+    // Everything below reads tokens and blocks directly
+    sweep_stale();
+
     std::map<uint64_t, bool> block_visited;
     std::vector<uint64_t> block_list;
     block_list.push_back(func);
@@ -161,26 +403,27 @@ void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
     
     while(block_list.size())
     {
-        uint64_t b = *(block_list.end() - 1);
+        uint64_t b = block_list.back();
         block_list.pop_back();
 
-        if (!tokens[b].size()) continue;
+        auto block_tokens = tokens.find(b);
+        if (block_tokens == tokens.end() || block_tokens->second.empty()) continue;
 
         L2C_Token last_token = L2C_Token();
-        last_token.str = "";
+        last_token.sym = L2C_TokenSym_None;
 
         int num_jumps = 0;
-        for (auto t : tokens[b])
+        for (auto& t : block_tokens->second)
         {
-            if (t.str != "BLOCK_MERGE" && t.str != "SPLIT_BLOCK_MERGE" && t.str != "DIV_TRUE" && t.str != "SUB_RET")
+            if (t.sym != L2C_TokenSym_BlockMerge && t.sym != L2C_TokenSym_SplitBlockMerge && t.sym != L2C_TokenSym_DivTrue && t.sym != L2C_TokenSym_SubRet)
             {
                 if (addr_in_token[t.pc])
-                    printf_warn("Token address overlap at %" PRIx64 " in block %" PRIx64 "\n", t.pc, block_hash(b));
+                    printf_warn("Token address overlap at %" PRIx64 " in block %" PRIx64 "\n", t.pc, block_label(b));
 
                 addr_in_token[t.pc] = true;
             }
         
-            if (t.str == "SUB_BRANCH" || t.str == "SUB_GOTO" || t.str == "DIV_FALSE" || t.str == "DIV_TRUE" || t.str == "CONV" || t.str == "BLOCK_MERGE" || t.str == "SPLIT_BLOCK_MERGE")
+            if (t.is_edge())
             {
                 if (!block_visited[t.args[0]])
                 {
@@ -188,35 +431,36 @@ void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
                     block_visited[t.args[0]] = true;
                 }
                 
-                if (!tokens[t.args[0]].size())
+                auto dest_tokens = tokens.find(t.args[0]);
+                if (dest_tokens == tokens.end() || dest_tokens->second.empty())
                 {
-                    printf_warn("Destination %" PRIx64 " from %s at %" PRIx64 " is empty!\n", t.args[0], t.str.c_str(), t.pc);
+                    printf_warn("Destination %" PRIx64 " from %s at %" PRIx64 " is empty!\n", t.args[0], t.name().c_str(), t.pc);
                 }
             }
             
-            if (t.str == "SUB_GOTO" || t.str == "DIV_FALSE" || t.str == "CONV" || t.str == "BLOCK_MERGE" || t.str == "SPLIT_BLOCK_MERGE" || t.str == "NORETURN" || t.str == "SUB_RET")
+            if (t.sym == L2C_TokenSym_SubGoto || t.sym == L2C_TokenSym_DivFalse || t.sym == L2C_TokenSym_Conv || t.sym == L2C_TokenSym_BlockMerge || t.sym == L2C_TokenSym_SplitBlockMerge || t.sym == L2C_TokenSym_Noreturn || t.sym == L2C_TokenSym_SubRet)
                 num_jumps++;
 
-            if (t.str == "DIV_TRUE" && last_token.str != "DIV_FALSE")
+            if (t.sym == L2C_TokenSym_DivTrue && last_token.sym != L2C_TokenSym_DivFalse)
                 printf_warn("Dangling DIV_TRUE at %" PRIx64 "\n", t.pc);
 
-            if (last_token.str == "BLOCK_MERGE" || last_token.str == "SPLIT_BLOCK_MERGE" || last_token.str == "SUB_GOTO" || last_token.str == "CONV" || last_token.str == "DIV_TRUE")
+            if (last_token.sym == L2C_TokenSym_BlockMerge || last_token.sym == L2C_TokenSym_SplitBlockMerge || last_token.sym == L2C_TokenSym_SubGoto || last_token.sym == L2C_TokenSym_Conv || last_token.sym == L2C_TokenSym_DivTrue)
             {
-                printf_warn("%s found mid-block at %" PRIx64 " and not at end as expected!\n", last_token.str.c_str(), last_token.pc);
+                printf_warn("%s found mid-block at %" PRIx64 " and not at end as expected!\n", last_token.name().c_str(), last_token.pc);
             }
 
             fork_token_instances[t.fork_hierarchy_str()]++;
             last_token = t;
         }
         
-        if (last_token.str == "DIV_FALSE")
+        if (last_token.sym == L2C_TokenSym_DivFalse)
             printf_warn("Dangling DIV_FALSE at %" PRIx64 "\n", last_token.pc);
         
         for (uint64_t i = blocks[b].addr; i < blocks[b].addr_end; i += 4)
         {
             //printf("%llx %llx\n", blocks[b].addr, blocks[b].addr_end);
             if (addr_in_block[i])
-                printf_warn("Address range overlap at %" PRIx64 " in block %" PRIx64 "\n", i, block_hash(b));
+                printf_warn("Address range overlap at %" PRIx64 " in block %" PRIx64 "\n", i, block_label(b));
 
             addr_in_block[i] = true;
         }
@@ -224,13 +468,11 @@ void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
         // With is_noreturn, one missing exit token is permitted.
         if (!num_jumps && !is_noreturn)
         {
-            printf_warn("Block %" PRIx64 " is missing an exit token!\n", block_hash(b));
+            printf_warn("Block %" PRIx64 " is missing an exit token!\n", block_label(b));
             is_noreturn = false;
         }
         else if (num_jumps > 1)
-            printf_warn("Block %" PRIx64 " has too many exit tokens!\n", block_hash(b));
-        
-        std::sort(block_list.begin(), block_list.end(), std::greater<int>()); 
+            printf_warn("Block %" PRIx64 " has too many exit tokens!\n", block_label(b));
     }
     
     for (auto& map_pair : fork_token_instances)
@@ -246,7 +488,7 @@ void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
             for (auto& token : block_tokens)
             {
                 std::string forkstr = token.fork_hierarchy_str();
-                if (forkstr == map_pair.first && token.str == "CONV")
+                if (forkstr == map_pair.first && token.sym == L2C_TokenSym_Conv)
                 {
                     to_remove.push_back(token);
                 }
@@ -258,51 +500,53 @@ void ClusterManager::clean_and_verify_blocks(uint64_t func, bool is_noreturn)
                 {
                     printf_debug("Pruning %s", token.to_string(this).c_str());
                 }
-                block_tokens.erase(token);
+                erase_token(block, token);
             }
         }
     }
 }
 
-void ClusterManager::print_block(uint64_t b, std::ofstream& file)
+void ClusterManager::print_block(uint64_t b, std::ostream& file)
 {
     char tmp[1024];
     std::string out = "";
     /*if (block_printed[b])
     {
-        snprintf(tmp, 255, "\nBlock %" PRIx64 " type %u, size %x, %u tokens, creation %s: See earlier definition\n",  block_hash(b), blocks[b].type, blocks[b].size(), tokens[b].size(), blocks[b].fork_hierarchy_str().c_str());
+        snprintf(tmp, 255, "\nBlock %" PRIx64 " type %u, size %x, %u tokens, creation %s: See earlier definition\n",  block_label(b), blocks[b].type, blocks[b].size(), tokens[b].size(), blocks[b].fork_hierarchy_str().c_str());
         out += std::string(tmp);
         return out;
     }*/
 
     //snprintf(tmp, 255, "\nBlock %" PRIx64 " (end %" PRIx64 ") type %u, size %x, %u tokens, creation %s:\n", b, blocks[b].addr_end, blocks[b].type, blocks[b].size(), tokens[b].size(), blocks[b].fork_hierarchy_str().c_str());
-    snprintf(tmp, 1024, "\nBlock %" PRIx64 " type %u, size %x, %u tokens, creation %s:\n", block_hash(b), blocks[b].type, blocks[b].size(), tokens[b].size(), blocks[b].fork_hierarchy_str().c_str());
+    auto& block = live_block(b);
+    auto& block_tokens = live_tokens(b);
+    snprintf(tmp, 1024, "\nBlock %" PRIx64 " type %u, size %x, %u tokens, creation %s:\n", block_label(b), block.type, block.size(), block_tokens.size(), block.fork_hierarchy_str().c_str());
     file << std::string(tmp);
 
     std::vector<L2C_Token> args;
 
-    for (auto& t : tokens[b])
+    for (auto& t : block_tokens)
     {
-        if (t.str.find("~L2CValue") != std::string::npos) {
+        if (t.name().find("~L2CValue") != std::string::npos) {
             args.clear();
             continue;
-        } else if (t.str.find("as_integer") != std::string::npos) {
+        } else if (t.name().find("as_integer") != std::string::npos) {
             args.push_back(t);
             // continue;
-        } else if (t.str.find("as_number") != std::string::npos) {
+        } else if (t.name().find("as_number") != std::string::npos) {
             args.push_back(t);
             continue;
-        } else if (t.str.find("as_hash") != std::string::npos) {
+        } else if (t.name().find("as_hash") != std::string::npos) {
             args.push_back(t);
             continue;
-        } else if (t.str.find("lib::L2CValue::L2CValue(") != std::string::npos) {
+        } else if (t.name().find("lib::L2CValue::L2CValue(") != std::string::npos) {
             // continue;
         }
         try {
             t.to_file(this, b, file);
-            if (t.str.find("app::lua_bind") != std::string::npos) {
+            if (t.name().find("app::lua_bind") != std::string::npos) {
                 for (auto arg: args) {
-                    if (arg.str.find("as_integer") != std::string::npos) {
+                    if (arg.name().find("as_integer") != std::string::npos) {
                         snprintf(tmp, 1024, "0x%lx", arg.args[0]);
                         file << " " + std::string(tmp);
                         for (auto j : arg.arg_is_const_value) {
@@ -311,10 +555,10 @@ void ClusterManager::print_block(uint64_t b, std::ofstream& file)
                                 break;
                             }
                         }
-                    } else if (arg.str.find("as_number") != std::string::npos) {
+                    } else if (arg.name().find("as_number") != std::string::npos) {
                         snprintf(tmp, 1024, "%f", arg.fargs[0]);
                         file << " " + std::string(tmp);
-                    } else if (arg.str.find("as_hash") != std::string::npos) {
+                    } else if (arg.name().find("as_hash") != std::string::npos) {
                         snprintf(tmp, 1024, "%f", arg.args[0]);
                         file << " " + std::string(tmp);
                     }
@@ -324,7 +568,7 @@ void ClusterManager::print_block(uint64_t b, std::ofstream& file)
         } catch (std::exception& e) {
             std::cout << "Failed to write blocks with exception:" << std::endl;
             std::cout << e.what() << std::endl;
-            std::cout << t.str << std::endl;
+            std::cout << t.name() << std::endl;
         }
     }
     
@@ -333,131 +577,196 @@ void ClusterManager::print_block(uint64_t b, std::ofstream& file)
     return;
 }
 
-void ClusterManager::print_blocks(uint64_t func, std::ofstream& file, std::unordered_map<uint64_t, bool>* block_visited)
+void ClusterManager::freeze_graph()
 {
-    char tmp[256];
-    std::string out = "";
-    std::map<uint64_t, bool> block_skipped;
-    std::vector<uint64_t> block_visited_here;
-    std::vector<uint64_t> block_list;
-    block_list.push_back(func);
+    if (graph_frozen) return;
 
-    bool needs_free = false;
-    if (!block_visited)
+    sweep_stale();
+    graph = BlockGraph();
+    
+    // Every block with tokens is a node, as is anything an edge lands on
+    for (auto& pair : tokens)
     {
-        block_visited = new std::unordered_map<uint64_t, bool>();
-        needs_free = true;
+        if (pair.second.empty()) continue;
+
+        graph.addrs.push_back(pair.first);
+        for (auto& t : pair.second)
+        {
+            if (t.is_edge())
+                graph.addrs.push_back(t.args[0]);
+        }
     }
+    std::sort(graph.addrs.begin(), graph.addrs.end());
+    graph.addrs.erase(std::unique(graph.addrs.begin(), graph.addrs.end()), graph.addrs.end());
     
-    if ((*block_visited)[func]) return;
+    graph.edge_start.resize(graph.size() + 1);
+    for (uint32_t node = 0; node < graph.size(); node++)
+    {
+        graph.edge_start[node] = graph.edge_to.size();
+        
+        auto block_tokens = tokens.find(graph.addrs[node]);
+        if (block_tokens == tokens.end()) continue;
+
+        for (auto& t : block_tokens->second)
+        {
+            if (!t.is_edge()) continue;
+            
+            uint32_t to;
+            graph.find(t.args[0], to);
+            graph.edge_to.push_back(to);
+            graph.edge_is_call.push_back(t.sym == L2C_TokenSym_SubBranch);
+        }
+    }
+    graph.edge_start[graph.size()] = graph.edge_to.size();
     
-    (*block_visited)[func] = true;
-    block_visited_here.push_back(func);
+    graph_frozen = true;
+}
 
-    while(block_list.size())
+void ClusterManager::print_blocks(uint64_t func, std::ostream& file)
+{
+    freeze_graph();
+    
+    uint32_t root;
+    if (!graph.find(func, root))
     {
-        uint64_t b = *(block_list.end() - 1);
-        block_list.pop_back();
+        print_block(func, file);
+        return;
+    }
+
+    std::vector<bool> block_visited(graph.size());
+    print_blocks(root, file, block_visited);
+}
+
+// Prints everything reachable from root without going through a call,
+// then each called subroutine after it in address order
+void ClusterManager::print_blocks(uint32_t root, std::ostream& file, std::vector<bool>& block_visited)
+{
+    std::set<uint32_t> block_skipped;
+    std::vector<uint32_t> block_visited_here;
+    std::vector<uint32_t> block_list;
 
-        if (!tokens[b].size()) continue;
+    if (block_visited[root]) return;
+    
+    block_visited[root] = true;
+    block_visited_here.push_back(root);
+    block_list.push_back(root);
+
+    while (block_list.size())
+    {
+        uint32_t node = block_list.back();
+        block_list.pop_back();
 
-        //out += print_block(b);
-        for (auto t : tokens[b])
+        for (uint32_t edge = graph.edge_start[node]; edge < graph.edge_start[node + 1]; edge++)
         {
-            if (t.str == "SUB_BRANCH" || t.str == "SUB_GOTO" || t.str == "DIV_FALSE" || t.str == "DIV_TRUE" || t.str == "CONV" || t.str == "BLOCK_MERGE" || t.str == "SPLIT_BLOCK_MERGE")
+            uint32_t to = graph.edge_to[edge];
+            if (block_visited[to]) continue;
+
+            if (!graph.edge_is_call[edge] && !block_skipped.count(to))
             {
-                if (!(*block_visited)[t.args[0]] && !block_skipped[t.args[0]] && t.str != "SUB_BRANCH")
-                {
-                    block_list.push_back(t.args[0]);
-                    (*block_visited)[t.args[0]] = true;
-                    block_visited_here.push_back(t.args[0]);
-                }
-                else if (!(*block_visited)[t.args[0]])
-                {
-                    block_skipped[t.args[0]] = true;
-                }
+                block_list.push_back(to);
+                block_visited[to] = true;
+                block_visited_here.push_back(to);
+            }
+            else
+            {
+                block_skipped.insert(to);
             }
         }
-        
-        //std::sort(block_list.begin(), block_list.end(), std::greater<int>());
     }
     
-    for (auto b : block_visited_here)
+    for (uint32_t node : block_visited_here)
     {
-        print_block(b, file);
+        print_block(graph.addrs[node], file);
     }
     
-    for (auto& pair : block_skipped)
+    for (uint32_t node : block_skipped)
     {
-        uint64_t b = pair.first;
-        
-        print_blocks(b, file, block_visited);
+        print_blocks(node, file, block_visited);
     }
+}
+
+void ClusterManager::invalidate_block(EmuInstance* inst, uint64_t b, uint64_t func)
+{
+    // A block that's already stale had its range cleared when it went stale
+    L2C_CodeBlock* block = nullptr;
+    auto iter = blocks.find(b);
+    if (iter != blocks.end() && iter->second.gen == block_gen(b))
+        block = &iter->second;
     
-    if (needs_free) delete block_visited;
+    uint64_t addr = block ? block->addr : 0;
+    uint64_t addr_end = block ? block->addr_end : 0;
 
-    file << out;
+    printf_verbose("Instance Id %u: Invalidated block %" PRIx64 " (type %u) from chain %" PRIx64 "\n", inst->get_id(), b, block ? block->type : L2C_CodeBlockType_Invalid, func);
     
-    return;
+    inst->purge_forks_in_range(addr, addr_end);
+
+    converge_points.reset_range(addr, addr_end);
+    fork_origins.reset_range(addr, addr_end);
+    block_ranges.erase(b);
+
+    // The block and its tokens stay put until swept, along with the
+    // convergence bits at token pcs outside of its range
+    block_gens[b]++;
+    stale_blocks.push_back(b);
+    graph_frozen = false;
+    
+    if (stale_blocks.size() >= STALE_SWEEP_BATCH)
+        sweep_stale();
 }
 
 void ClusterManager::invalidate_blocktree(EmuInstance* inst, uint64_t func)
 {
-    std::map<uint64_t, bool> block_visited = std::map<uint64_t, bool>();
-    std::vector<uint64_t> block_list = std::vector<uint64_t>();
+    // Most calls land on a subroutine or import stub that has nothing under
+    // it yet, which only needs its own block reset
+    auto root_succs = block_succs.find(func);
+    if (root_succs == block_succs.end() || root_succs->second.empty() || tokens_stale(func))
+    {
+        invalidate_block(inst, func, func);
+        printf_verbose("Instance Id %u: Invalidated 1 block(s)\n", inst->get_id());
+        return;
+    }
+
+    // Blocks are marked visited with the current walk's epoch, so the
+    // marks never have to be cleared between walks
+    if (++walk_epoch == 0)
+    {
+        block_walk_epoch.clear();
+        walk_epoch = 1;
+    }
+    uint32_t epoch = walk_epoch;
+    std::vector<uint64_t> block_list;
+    std::vector<uint64_t> block_visited;
     block_list.push_back(func);
-    block_visited[func] = true;
-    
-    //printf(print_blocks(func).c_str());
+    block_visited.push_back(func);
+    block_walk_epoch[func] = epoch;
 
-    while(block_list.size())
+    while (block_list.size())
     {
-        uint64_t b = *(block_list.end() - 1);
+        uint64_t b = block_list.back();
         block_list.pop_back();
 
-        if (!tokens[b].size()) continue;
+        // Edges out of a stale block went with it
+        auto succs = block_succs.find(b);
+        if (succs == block_succs.end() || tokens_stale(b)) continue;
 
-        for (auto t : tokens[b])
+        for (auto& succ : succs->second)
         {
-            if (t.str == "SUB_BRANCH" || t.str == "SUB_GOTO" || t.str == "DIV_FALSE" || t.str == "DIV_TRUE" || t.str == "CONV" || t.str == "BLOCK_MERGE" || t.str == "SPLIT_BLOCK_MERGE")
+            uint32_t& mark = block_walk_epoch[succ.first];
+            if (mark != epoch)
             {
-                if (!block_visited[t.args[0]])
-                {
-                    block_list.push_back(t.args[0]);
-                    block_visited[t.args[0]] = true;
-                    
-                    //printf("%llx %s\n", t.args[0], t.str.c_str());
-                }
+                mark = epoch;
+                block_list.push_back(succ.first);
+                block_visited.push_back(succ.first);
             }
         }
-        
-        std::sort(block_list.begin(), block_list.end(), std::greater<int>());
     }
     
-    for (auto& pair : block_visited)
+    std::sort(block_visited.begin(), block_visited.end());
+    for (uint64_t b : block_visited)
     {
-        printf_verbose("Instance Id %u: Invalidated block %" PRIx64 " (type %u) from chain %" PRIx64 "\n", inst->get_id(), pair.first, blocks[pair.first].type, func);
-        
-        inst->purge_forks_in_range(blocks[pair.first].addr, blocks[pair.first].addr_end);
-    
-        //printf("%llx %llx\n", blocks[pair.first].addr, blocks[pair.first].addr_end);
-        for (uint64_t i = blocks[pair.first].addr; i < blocks[pair.first].addr_end; i++)
-        {
-            converge_points[i] = false;
-            fork_origins[i] = false;
-        }
-    
-        // In case there's anything weird going on...
-        for (auto& t : tokens[pair.first])
-        {
-            converge_points[t.pc] = false;
-            fork_origins[t.pc] = false;
-        }
-    
-        tokens[pair.first].clear();
-        blocks[pair.first] = L2C_CodeBlock();
+        invalidate_block(inst, b, func);
     }
-    printf_verbose("Instance Id %u: Invalidated %u block(s)\n", inst->get_id(), block_visited.size());
+    printf_verbose("Instance Id %u: Invalidated %zu block(s)\n", inst->get_id(), block_visited.size());
 }
 
 uint64_t ClusterManager::execute(uint64_t start, bool run_slow, bool reset_heap_after, uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3)
@@ -483,19 +792,20 @@ std::thread* ClusterManager::execute_threaded(uint64_t start, void (*on_complete
 
 void ClusterManager::split_block(uint64_t block, uint64_t addr)
 {
-    uint64_t splitting_addr = blocks[block].addr;
-    uint64_t splitting_addr_end = blocks[block].addr_end;
+    uint64_t splitting_addr = live_block(block).addr;
+    uint64_t splitting_addr_end = live_block(block).addr_end;
 
-    std::set<L2C_Token> to_split = tokens[splitting_addr];
-    tokens[splitting_addr].clear();
-    tokens[addr].clear();
+    L2C_TokenSet to_split = live_tokens(splitting_addr);
+    clear_block_tokens(splitting_addr);
+    sweep_block(addr);
+    clear_block_tokens(addr);
       
     L2C_CodeBlock a, b;
-    a = blocks[splitting_addr];
+    a = live_block(splitting_addr);
     a.addr = splitting_addr;
     a.addr_end = addr;
 
-    b = blocks[splitting_addr];
+    b = live_block(splitting_addr);
     b.addr = addr;
     b.addr_end = splitting_addr_end;
 
@@ -507,17 +817,17 @@ void ClusterManager::split_block(uint64_t block, uint64_t addr)
     {
         if (token.pc >= a.addr && token.pc < a.addr_end)
         {
-            tokens[splitting_addr].insert(token);
+            insert_token(splitting_addr, token);
             
             last_a_token = token;
             //printf("a ");
             //token.print();
         }
         else if ((token.pc >= b.addr && token.pc < b.addr_end) 
-                 || ((token.str == "BLOCK_MERGE" || token.str == "SPLIT_BLOCK_MERGE") 
+                 || ((token.sym == L2C_TokenSym_BlockMerge || token.sym == L2C_TokenSym_SplitBlockMerge) 
                      && token.pc == b.addr_end))
         {
-            tokens[addr].insert(token);
+            insert_token(addr, token);
             
             //printf("b ");
             //token.print();
@@ -531,21 +841,21 @@ void ClusterManager::split_block(uint64_t block, uint64_t addr)
     L2C_Token token;
     token.pc = a.addr_end;
     token.fork_hierarchy = last_a_token.fork_hierarchy;
-    token.str = "SPLIT_BLOCK_MERGE";
+    token.sym = L2C_TokenSym_SplitBlockMerge;
     token.type = L2C_TokenType_Meta;
     token.args.push_back(b.addr);
     add_token_by_prio(a.addr, token);
 
-    blocks[splitting_addr] = a;
-    blocks[addr] = b;
+    set_block(splitting_addr, a);
+    set_block(addr, b);
 }
 
-bool ClusterManager::convergable_block(uint64_t block, std::vector<int> comp)
+bool ClusterManager::convergable_block(uint64_t block, const std::vector<int>& comp)
 {
-    auto b = blocks[block];
+    auto b = live_block(block);
     if (!b.fork_hierarchy.size()) return false;
     if (b.fork_hierarchy.size() == 1 && comp.size() > 1) return true;
-    if (b.fork_hierarchy == comp && comp.size() == 1 && tokens[block].size()) return true;
+    if (b.fork_hierarchy == comp && comp.size() == 1 && live_tokens(block).size()) return true;
 
     if (b.fork_hierarchy.size() == comp.size())
         return b.creator() < comp[0];
@@ -553,30 +863,99 @@ bool ClusterManager::convergable_block(uint64_t block, std::vector<int> comp)
     return b.fork_hierarchy.size() < comp.size();
 }
 
+// 64-bit multiply-xorshift mixing, only needs to be fast and spread well
+static uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_str(uint64_t h, const std::string& str)
+{
+    for (size_t i = 0; i < str.length(); i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, str.data() + i, std::min<size_t>(8, str.length() - i));
+        h = hash_mix(h, word);
+    }
+    return hash_mix(h, str.length());
+}
+
+// Hashes what a block does rather than where it is. Token pcs are taken
+// relative to the block, edge targets are left out, and so is the fork
+// hierarchy since instance ids depend on scheduling.
 uint64_t ClusterManager::block_hash(uint64_t addr)
 {
-    return addr;
-    uint32_t crc = 0;
-    for (auto& token : tokens[addr])
+    uint64_t h = 0;
+    
+    auto block_tokens = tokens.find(addr);
+    if (block_tokens == tokens.end()) return h;
+
+    for (auto& token : block_tokens->second)
     {
-        for (int val : token.fork_hierarchy)
-            crc = crc32_part(&val, 4, crc);
+        h = hash_mix(h, token.pc - addr);
+        h = hash_str(h, token.name());
+        h = hash_mix(h, token.type);
+        if (token.is_edge()) continue;
 
-        crc = crc32_part(token.str.c_str(), token.str.length(), crc);
-        crc = crc32_part(&token.type, sizeof(token.type), crc);
-        if (token.str == "SUB_BRANCH" || token.str == "SUB_GOTO" || token.str == "DIV_FALSE" || token.str == "DIV_TRUE" || token.str == "CONV" || token.str == "BLOCK_MERGE" || token.str == "SPLIT_BLOCK_MERGE")
-        {
+        for (uint64_t arg : token.args)
+            h = hash_mix(h, arg);
 
+        for (float farg : token.fargs)
+        {
+            uint32_t bits;
+            memcpy(&bits, &farg, sizeof(bits));
+            h = hash_mix(h, bits);
         }
-        else
+    }
+    
+    return hash_mix(h, block_tokens->second.size());
+}
+
+// Blocks are numbered in the order a walk from func first reaches them,
+// and edges hash as those numbers, so the same body at another address
+// hashes the same
+uint64_t ClusterManager::function_hash(uint64_t func)
+{
+    freeze_graph();
+    
+    uint32_t root;
+    if (!graph.find(func, root))
+        return block_hash(func);
+
+    std::vector<uint32_t> order(graph.size(), UINT32_MAX);
+    std::vector<uint32_t> block_list;
+    uint32_t next = 0;
+    uint64_t h = 0;
+    
+    order[root] = next++;
+    block_list.push_back(root);
+    while (block_list.size())
+    {
+        uint32_t node = block_list.back();
+        block_list.pop_back();
+        
+        h = hash_mix(h, block_hash(graph.addrs[node]));
+        for (uint32_t edge = graph.edge_start[node]; edge < graph.edge_start[node + 1]; edge++)
         {
-            for (uint64_t arg : token.args)
-                crc = crc32_part(&arg, sizeof(arg), crc);
-            
-            for (float farg : token.fargs)
-                crc = crc32_part(&farg, sizeof(farg), crc);
+            uint32_t to = graph.edge_to[edge];
+            if (order[to] == UINT32_MAX)
+            {
+                order[to] = next++;
+                block_list.push_back(to);
+            }
+            h = hash_mix(h, order[to]);
         }
     }
     
-    return crc | (uint64_t)(tokens[addr].size() << 32);
+    return h;
+}
+
+// What blocks are called in output, their address
+uint64_t ClusterManager::block_label(uint64_t addr)
+{
+    return addr;
 }
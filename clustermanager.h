@@ -1,13 +1,20 @@
 #ifndef CLUSTERMANAGER_H
 #define CLUSTERMANAGER_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <stdint.h>
 #include <thread>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include "uc_inst.h"
+#include "emuengine.h"
 
 // memory addresses for different segments
 #define NRO 0x100000000
@@ -24,7 +31,223 @@
 #define STACK_SIZE (0x18000) // Check this...
 #define STACK_END (STACK + STACK_SIZE)
 
-extern int cluster_id_cnt;
+#define GUEST_PAGE_SIZE (0x1000)
+#define GUEST_PAGE_ALIGN(x) ((x) & ~(uint64_t)(GUEST_PAGE_SIZE - 1))
+
+// Granularity block starts are indexed at for containment lookups
+#define BLOCK_BUCKET_SIZE (0x400)
+
+// How many invalidated blocks can be left stale before they're swept together
+#define STALE_SWEEP_BATCH (256)
+
+extern std::atomic<int> cluster_id_cnt;
+
+bool image_share(void* nro_mem, void* import_mem);
+bool image_is_shared();
+void* image_copy(void* mem, uint64_t offset, uint64_t size, void* src, bool mapped);
+void image_release(void* mem, uint64_t size, bool mapped);
+
+// One bit per instruction in the NRO, anything outside of it reads as unset.
+// Nothing is allocated until the first bit gets set.
+class NroBitmap
+{
+private:
+    std::vector<uint64_t> words;
+    
+    static bool in_range(uint64_t addr)
+    {
+        return addr >= NRO && addr < NRO + NRO_SIZE;
+    }
+
+public:
+    bool test(uint64_t addr) const
+    {
+        if (!in_range(addr) || words.empty()) return false;
+
+        uint64_t bit = (addr - NRO) / 4;
+        return (words[bit / 64] >> (bit % 64)) & 1;
+    }
+    
+    void set(uint64_t addr)
+    {
+        if (!in_range(addr)) return;
+        if (words.empty())
+            words.resize(NRO_SIZE / 4 / 64);
+
+        uint64_t bit = (addr - NRO) / 4;
+        words[bit / 64] |= 1ull << (bit % 64);
+    }
+    
+    void reset(uint64_t addr)
+    {
+        if (!in_range(addr) || words.empty()) return;
+
+        uint64_t bit = (addr - NRO) / 4;
+        words[bit / 64] &= ~(1ull << (bit % 64));
+    }
+    
+    // Clears [start, end), whole words at a time where possible
+    void reset_range(uint64_t start, uint64_t end)
+    {
+        if (start < NRO) start = NRO;
+        if (end > NRO + NRO_SIZE) end = NRO + NRO_SIZE;
+        if (start >= end || words.empty()) return;
+
+        uint64_t bit = (start - NRO) / 4;
+        uint64_t bit_end = (end - NRO + 3) / 4;
+        
+        while (bit < bit_end && bit % 64)
+        {
+            words[bit / 64] &= ~(1ull << (bit % 64));
+            bit++;
+        }
+        
+        while (bit + 64 <= bit_end)
+        {
+            words[bit / 64] = 0;
+            bit += 64;
+        }
+        
+        while (bit < bit_end)
+        {
+            words[bit / 64] &= ~(1ull << (bit % 64));
+            bit++;
+        }
+    }
+    
+    void clear()
+    {
+        std::fill(words.begin(), words.end(), 0);
+    }
+};
+
+// Start to end of every block with a range. Starts inside the NRO are also
+// bucketed every BLOCK_BUCKET_SIZE bytes under a tree holding the furthest
+// end in each subtree, so finding the lowest block containing an address
+// is a descent plus a scan of one bucket, however long any block gets.
+class BlockRanges
+{
+private:
+    ArenaMap<uint64_t, uint64_t> ranges;
+    std::vector<uint64_t> max_end;
+    size_t leaves = 0;
+    
+    static bool in_range(uint64_t addr)
+    {
+        return addr >= NRO && addr < NRO + NRO_SIZE;
+    }
+    
+    static uint64_t bucket_start(size_t bucket)
+    {
+        return NRO + bucket * BLOCK_BUCKET_SIZE;
+    }
+    
+    void update_bucket(uint64_t start)
+    {
+        if (!in_range(start)) return;
+        if (max_end.empty())
+        {
+            for (leaves = 1; leaves < NRO_SIZE / BLOCK_BUCKET_SIZE; leaves *= 2);
+            max_end.resize(leaves * 2);
+        }
+        
+        size_t bucket = (start - NRO) / BLOCK_BUCKET_SIZE;
+        uint64_t end = 0;
+        for (auto iter = ranges.lower_bound(bucket_start(bucket)); iter != ranges.end() && iter->first < bucket_start(bucket + 1); iter++)
+        {
+            end = std::max(end, iter->second);
+        }
+        
+        size_t node = leaves + bucket;
+        max_end[node] = end;
+        for (node /= 2; node; node /= 2)
+        {
+            max_end[node] = std::max(max_end[node * 2], max_end[node * 2 + 1]);
+        }
+    }
+    
+    // Lowest bucket under limit holding a block which ends past addr
+    bool first_bucket(size_t node, size_t lo, size_t hi, size_t limit, uint64_t addr, size_t& out) const
+    {
+        if (lo >= limit || max_end[node] <= addr) return false;
+        if (hi - lo == 1)
+        {
+            out = lo;
+            return true;
+        }
+        
+        size_t mid = (lo + hi) / 2;
+        return first_bucket(node * 2, lo, mid, limit, addr, out) || first_bucket(node * 2 + 1, mid, hi, limit, addr, out);
+    }
+
+public:
+    BlockRanges(Arena* arena) : ranges(arena) {}
+    
+    void set(uint64_t start, uint64_t end)
+    {
+        ranges[start] = end;
+        update_bucket(start);
+    }
+    
+    void erase(uint64_t start)
+    {
+        if (!ranges.erase(start)) return;
+        update_bucket(start);
+    }
+    
+    void clear()
+    {
+        ranges.clear();
+        std::fill(max_end.begin(), max_end.end(), 0);
+    }
+    
+    // Blocks shouldn't overlap, but if they do the lowest one wins like it
+    // did back when blocks got walked front to back
+    uint64_t lowest_containing(uint64_t addr, bool exclude_start) const
+    {
+        // Nothing gets bucketed outside the NRO, those few are just walked
+        uint64_t from = addr >= NRO + NRO_SIZE ? NRO + NRO_SIZE : 0;
+        if (in_range(addr) && !max_end.empty())
+        {
+            size_t bucket = (addr - NRO) / BLOCK_BUCKET_SIZE;
+            size_t found;
+            from = bucket_start(first_bucket(1, 0, leaves, bucket, addr, found) ? found : bucket);
+        }
+        
+        for (auto iter = ranges.lower_bound(from); iter != ranges.end() && iter->first <= addr; iter++)
+        {
+            if (addr < iter->second && !(exclude_start && addr == iter->first))
+                return iter->first;
+        }
+        
+        return 0;
+    }
+};
+
+// Successor edges of a function's blocks in CSR form, packed once the
+// function is done so traversals walk flat arrays. Nodes are numbered in
+// address order and each node's edges keep the order of its tokens.
+struct BlockGraph
+{
+    std::vector<uint64_t> addrs;
+    std::vector<uint32_t> edge_start;
+    std::vector<uint32_t> edge_to;
+    std::vector<bool> edge_is_call;
+
+    size_t size() const
+    {
+        return addrs.size();
+    }
+    
+    bool find(uint64_t addr, uint32_t& node) const
+    {
+        auto iter = std::lower_bound(addrs.begin(), addrs.end(), addr);
+        if (iter == addrs.end() || *iter != addr) return false;
+
+        node = iter - addrs.begin();
+        return true;
+    }
+};
 
 class ClusterManager
 {
@@ -32,22 +255,80 @@ private:
     int id;
     void* nro_mem;
     void* import_mem;
-    uc_engine* uc;
+    
+    // NRO and IMPORTS are private mappings of the shared image rather than
+    // malloc'd copies, and how much of them counts against the memory budget
+    bool mem_mapped = false;
+    uint64_t mem_charged = 0;
+    
+    EmuEngine* engine;
+    std::vector<EmuEngine*> fork_engines;
     EmuInstance* inst;
-    EmuInstance* running;
-    int instance_id_cnt = 0;
-    std::map<uint64_t, bool> fork_origins;
-    std::map<uint64_t, bool> block_printed;
+    std::atomic<int> instance_id_cnt;
+    std::atomic<uint64_t> slices;
+    
+    // Backs all of the node-based analysis state below, so a cluster's
+    // containers are torn down in one go along with it
+    Arena arena;
+    
+    NroBitmap fork_origins;
+    ArenaMap<uint64_t, bool> block_printed{&arena};
+    
+    // Every fork hierarchy tokens and blocks point at, interned once per
+    // instance rather than per token
+    std::mutex hierarchy_lock;
+    ArenaSet<std::vector<int> > hierarchies{&arena};
+    std::set<uint64_t> code_hooks;
+    
+    // Ranges of live blocks, a block's range is dropped when it goes stale
+    BlockRanges block_ranges{&arena};
+    
+    // Which blocks hold tokens at a given pc, kept in sync with tokens
+    ArenaMap<uint64_t, ArenaSet<uint64_t> > token_blocks{&arena};
+    
+    // Live successor counts per block, kept in sync with edge tokens,
+    // and the packed copy of them once a function is done
+    ArenaMap<uint64_t, ArenaMap<uint64_t, uint32_t> > block_succs{&arena};
+    BlockGraph graph;
+    bool graph_frozen = false;
+    
+    // Visit marks for invalidate_blocktree, a block counts as visited
+    // when its mark matches the walk in progress
+    ArenaMap<uint64_t, uint32_t> block_walk_epoch{&arena};
+    uint32_t walk_epoch = 0;
+    
+    // Invalidating a block only bumps its generation, a block or token
+    // stamped with an older one is stale and reads as absent. Stale blocks
+    // are reclaimed when next touched or in batches of STALE_SWEEP_BATCH.
+    ArenaMap<uint64_t, uint32_t> block_gens{&arena};
+    std::vector<uint64_t> stale_blocks;
+    
+    NroBitmap converge_points;
+    L2C_BlockMap blocks{&arena};
+    
+    // Guards the analysis state when forks run on more than one engine
+    std::recursive_mutex state_mutex;
     
     bool heap_fixed = false;
 
+    uint32_t block_gen(uint64_t block)
+    {
+        auto iter = block_gens.find(block);
+        return iter != block_gens.end() ? iter->second : 0;
+    }
+    
+    bool tokens_stale(uint64_t block);
+    void sweep_block(uint64_t block);
+    void sweep_tokens_at(uint64_t pc);
+    void sweep_stale();
+
 public:
-    std::map<uint64_t, std::set<L2C_Token> > tokens;
-    std::map<uint64_t, bool> converge_points;
-    std::map<uint64_t, L2C_CodeBlock> blocks;
+    L2C_TokenMap tokens{&arena};
 
     ClusterManager(std::string nro_path)
     {
+        instance_id_cnt = 0;
+        slices = 0;
         nro_mem = malloc(NRO_SIZE);
         import_mem = malloc(IMPORTS_SIZE);
         FILE* f_nro = fopen(nro_path.c_str(), "rb");
@@ -66,34 +347,72 @@ public:
         id = cluster_id_cnt++;
     }
     
+    // Starts from an NRO and IMPORTS that an earlier run already relocated and
+    // set up, the symbol tables have to be restored before this
+    ClusterManager(const void* nro_image, const void* import_image)
+    {
+        instance_id_cnt = 0;
+        slices = 0;
+        nro_mem = malloc(NRO_SIZE);
+        import_mem = malloc(IMPORTS_SIZE);
+        memcpy(nro_mem, nro_image, NRO_SIZE);
+        memcpy(import_mem, import_image, IMPORTS_SIZE);
+
+        uc_init();
+        inst = new EmuInstance(this);
+        
+        id = cluster_id_cnt++;
+    }
+    
     ~ClusterManager() 
     {
+        // Each of these would have been its own malloc and free without the arena
+        printf_debug("Cluster %u: %" PRIu64 " analysis allocations (%" PRIu64 " bytes) served by %zu arena chunks\n", id, arena.get_allocs(), arena.get_bytes(), arena.get_chunks());
+
         delete inst;
         
-        uc_mem_unmap(uc, IMPORTS, IMPORTS_SIZE);
-        uc_mem_unmap(uc, NRO, NRO_SIZE);
-        
-        uc_close(uc);
+        for (auto fork_engine : fork_engines)
+            delete fork_engine;
+        delete engine;
         
-        free(import_mem);
-        free(nro_mem);
+        image_release(import_mem, IMPORTS_SIZE, mem_mapped);
+        image_release(nro_mem, NRO_SIZE, mem_mapped);
+        uc_res_release(mem_charged);
     }
     
-    ClusterManager(ClusterManager* to_clone)
+    // A detached engine from an earlier clone can be passed in to skip engine
+    // setup and keep its translated code, otherwise a new one is created
+    ClusterManager(ClusterManager* to_clone, EmuEngine* reuse = nullptr)
     {
+        auto time_start = std::chrono::steady_clock::now();
         instance_id_cnt = 0;
-        nro_mem = malloc(NRO_SIZE);
-        import_mem = malloc(IMPORTS_SIZE);
-        memcpy(nro_mem, to_clone->nro_mem, NRO_SIZE);
-        memcpy(import_mem, to_clone->import_mem, IMPORTS_SIZE);
+        slices = 0;
+        // Only pages the guest writes get duplicated when the image is shared,
+        // those aren't known up front so only full copies are charged
+        nro_mem = reuse ? reuse->get_nro_mem() : nullptr;
+        import_mem = reuse ? reuse->get_import_mem() : nullptr;
+        mem_mapped = reuse ? reuse->get_mem_mapped() : image_is_shared();
+        if (!mem_mapped)
+        {
+            mem_charged = NRO_SIZE + IMPORTS_SIZE;
+            uc_res_wait(-1, mem_charged);
+        }
         
-        fork_origins = to_clone->fork_origins;
-        block_printed = to_clone->block_printed;
-        tokens = to_clone->tokens;
-        converge_points = to_clone->converge_points;
-        blocks = to_clone->blocks;
+        nro_mem = image_copy(nro_mem, 0, NRO_SIZE, to_clone->nro_mem, mem_mapped);
+        import_mem = image_copy(import_mem, NRO_SIZE, IMPORTS_SIZE, to_clone->import_mem, mem_mapped);
         
-        uc_init();
+        // Analysis state starts out empty, what the parent has is left over from
+        // agent setup and none of it belongs to the function the clone runs
+        
+        if (reuse)
+        {
+            engine = reuse;
+            engine->attach(this);
+        }
+        else
+        {
+            uc_init();
+        }
         
         inst = new EmuInstance(this, to_clone->inst);
         
@@ -101,72 +420,91 @@ public:
         // memcpy(uc_ptr_to_real_ptr(unresolved_syms["phx::detail::CRC32Table::table_"]), crc32_tab, sizeof(crc32_tab));
         
         id = cluster_id_cnt++;
+        
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - time_start;
+        printf_debug("Cluster %u: Cloned from cluster %u in %.3fms%s\n", id, to_clone->id, elapsed.count(), reuse ? " (reused engine)" : "");
     }
     
-    void set_running_inst(EmuInstance* inst)
+    // Takes the main engine, along with the NRO and IMPORTS memory it maps,
+    // out of the cluster so it survives the cluster being deleted
+    EmuEngine* release_engine()
     {
-        running = inst;
+        EmuEngine* released = engine;
+        released->detach(mem_mapped);
+        
+        engine = nullptr;
+        nro_mem = nullptr;
+        import_mem = nullptr;
+        return released;
     }
     
-    EmuInstance* get_running_inst()
+    EmuEngine* get_engine()
     {
-        return running;
+        return engine;
     }
-
-    void add_import_hook(uint64_t addr)
+    
+    // The instance setup ran on, clones start from a copy of its state
+    EmuInstance* get_inst()
     {
-        uc_hook trace;
-        uc_hook_add(uc, &trace, UC_HOOK_CODE, (void*)hook_import, this, addr, addr);
+        return inst;
     }
-
-    uc_err uc_init()
+    
+    // Extra engines for running forks in parallel, kept around for reuse
+    EmuEngine* get_fork_engine(size_t idx)
     {
-        uc_err err;
-        uc_hook trace1, trace2, trace3;
+        std::lock_guard<std::recursive_mutex> lock(state_mutex);
 
-        err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
-        if (err) {
-            printf_error("Cluster %u: Failed on uc_open() with error returned: %u (%s)\n",
-                    get_id(), err, uc_strerror(err));
-            return err;
-        }
-        
-        uint32_t x;
-        uc_reg_read(uc, UC_ARM64_REG_CPACR_EL1, &x);
-        x |= 0x300000; // set FPEN bit
-        uc_reg_write(uc, UC_ARM64_REG_CPACR_EL1, &x);
+        while (fork_engines.size() <= idx)
+            fork_engines.push_back(new EmuEngine(this));
 
-        // import hooks
-        for (auto pair : unresolved_syms)
-        {
-            uc_hook trace;
+        return fork_engines[idx];
+    }
+    
+    std::recursive_mutex& get_state_mutex()
+    {
+        return state_mutex;
+    }
+    
+    void count_slice()
+    {
+        slices++;
+    }
+    
+    uint64_t get_slices()
+    {
+        return slices;
+    }
 
-            uc_hook_add(uc, &trace, UC_HOOK_CODE, (void*)hook_import, this, pair.second, pair.second);
-        }
-        // code hooks
-        // for (auto pair : resolved_syms)
-        // {
-        //     uc_hook trace;
+    void add_import_hook(uint64_t addr)
+    {
+        // IMPORTS is already covered by every engine's range hook
+        if (addr >= IMPORTS && addr < IMPORTS_END) return;
 
-        //     printf_verbose("Adding hook to %s\n", pair.first.c_str());
+        code_hooks.insert(addr);
 
-        //     uc_hook_add(uc, &trace, UC_HOOK_CODE, (void*)hook_import, this, pair.second, pair.second);
-        // }
-        
-        // // granular hooks
-        // uc_hook_add(uc, &trace1, UC_HOOK_CODE, (void*)hook_code, this, 1, 0);
-        uc_hook_add(uc, &trace2, UC_HOOK_MEM_UNMAPPED, (void*)hook_mem_invalid, this, 1, 0);
-        uc_hook_add(uc, &trace3, UC_HOOK_MEM_WRITE | UC_HOOK_MEM_READ, (void*)hook_memrw, this, 1, 0);
-        
-        uc_mem_map_ptr(uc, NRO, NRO_SIZE, UC_PROT_ALL, nro_mem);    
-        uc_mem_map_ptr(uc, IMPORTS, IMPORTS_SIZE, UC_PROT_ALL, import_mem);
-        
-        return err;
+        engine->add_code_hook(addr);
+        for (auto fork_engine : fork_engines)
+            fork_engine->add_code_hook(addr);
+    }
+    
+    bool is_code_hook(uint64_t addr)
+    {
+        return code_hooks.find(addr) != code_hooks.end();
+    }
+    
+    const std::set<uint64_t>& get_code_hooks()
+    {
+        return code_hooks;
+    }
+
+    void uc_init()
+    {
+        engine = new EmuEngine(this);
     }
     
     uc_engine* get_uc()
     {
-        return uc;
+        return engine->get_uc();
     }
     
     void set_heap_fixed(bool fixed)
@@ -193,6 +531,13 @@ public:
     {
         return import_mem;
     }
+    
+    // Called once the base cluster is fully set up, clones made afterwards
+    // map its NRO and IMPORTS copy-on-write instead of copying them
+    void share_image()
+    {
+        image_share(nro_mem, import_mem);
+    }
 
     void* uc_ptr_to_real_ptr(uint64_t ptr)
     {
@@ -204,21 +549,49 @@ public:
         return inst->heap_alloc(size);
     }
     
+    // Stale tokens at pc still hold their bits until swept, which has to
+    // happen before the bit is read or set again
     void set_fork_origin(uint64_t pc)
     {
-        fork_origins[pc] = true;
+        sweep_tokens_at(pc);
+        fork_origins.set(pc);
     }
     
     bool is_fork_origin(uint64_t pc)
     {
-        return fork_origins[pc];
+        if (!fork_origins.test(pc)) return false;
+
+        sweep_tokens_at(pc);
+        return fork_origins.test(pc);
+    }
+    
+    void set_converge_point(uint64_t pc)
+    {
+        sweep_tokens_at(pc);
+        converge_points.set(pc);
+    }
+    
+    bool is_converge_point(uint64_t pc)
+    {
+        if (!converge_points.test(pc)) return false;
+
+        sweep_tokens_at(pc);
+        return converge_points.test(pc);
     }
     
     void clear_state()
     {
         tokens.clear();
+        token_blocks.clear();
+        block_succs.clear();
+        graph_frozen = false;
         blocks.clear();
-        converge_points = std::map<uint64_t, bool>();
+        block_ranges.clear();
+        block_gens.clear();
+        stale_blocks.clear();
+        block_walk_epoch.clear();
+        walk_epoch = 0;
+        converge_points.clear();
     }
     
     int create_id()
@@ -226,22 +599,52 @@ public:
         return instance_id_cnt++;
     }
     
-    void remove_matching_tokens(uint64_t addr, std::string str);
-    void remove_block_matching_tokens(uint64_t block, uint64_t addr, std::string str);
-    bool token_by_addr_and_name_exists(uint64_t pc, std::string str);
+    L2C_ForkHierarchy intern_hierarchy(const std::vector<int>& hierarchy)
+    {
+        std::lock_guard<std::mutex> lock(hierarchy_lock);
+        return L2C_ForkHierarchy(&*hierarchies.insert(hierarchy).first);
+    }
+    
+    std::set<uint64_t> token_blocks_at(uint64_t pc)
+    {
+        auto iter = token_blocks.find(pc);
+        if (iter == token_blocks.end()) return std::set<uint64_t>();
+        
+        return std::set<uint64_t>(iter->second.begin(), iter->second.end());
+    }
+
+    L2C_TokenSet& live_tokens(uint64_t block);
+    L2C_CodeBlock& live_block(uint64_t addr);
+    L2C_CodeBlock* find_live_block(uint64_t addr);
+    std::pair<L2C_TokenSet::iterator, L2C_TokenSet::iterator> block_tokens_at(uint64_t block, uint64_t pc);
+    void insert_token(uint64_t block, const L2C_Token& token);
+    void erase_token(uint64_t block, L2C_Token token);
+    void clear_block_tokens(uint64_t block);
+    void remove_matching_tokens(uint64_t addr, uint32_t sym);
+    void remove_block_matching_tokens(uint64_t block, uint64_t addr, uint32_t sym);
+    bool token_by_addr_and_name_exists(uint64_t pc, uint32_t sym);
     void add_token_by_prio(uint64_t block, L2C_Token token);
     void add_subreplace_token(EmuInstance* inst, uint64_t block, L2C_Token token);
+    void set_block(uint64_t addr, const L2C_CodeBlock& block);
+    void set_block_end(uint64_t addr, uint64_t addr_end);
+    uint64_t lowest_block_containing(uint64_t addr, bool exclude_start);
     uint64_t find_containing_block(uint64_t addr);
+    uint64_t find_overlapping_block(uint64_t addr);
     void clean_and_verify_blocks(uint64_t func, bool is_noreturn);
-    void print_block(uint64_t b, std::ofstream& file);
-    void print_blocks(uint64_t func, std::ofstream& file, std::unordered_map<uint64_t, bool>* block_visited = nullptr);
+    void print_block(uint64_t b, std::ostream& file);
+    void print_blocks(uint64_t func, std::ostream& file);
+    void print_blocks(uint32_t root, std::ostream& file, std::vector<bool>& block_visited);
+    void freeze_graph();
     
+    void invalidate_block(EmuInstance* inst, uint64_t b, uint64_t func);
     void invalidate_blocktree(EmuInstance* inst, uint64_t func);
     uint64_t execute(uint64_t start, bool run_slow, bool reset_heap_after, uint64_t x0 = 0, uint64_t x1 = 0, uint64_t x2 = 0, uint64_t x3 = 0);
     std::thread* execute_threaded(uint64_t start, void (*on_complete)(ClusterManager* cluster, uint64_t ret, void* data), void* data, bool run_slow, bool reset_heap_after, uint64_t x0 = 0, uint64_t x1 = 0, uint64_t x2 = 0, uint64_t x3 = 0);
     void split_block(uint64_t block, uint64_t addr);
-    bool convergable_block(uint64_t block, std::vector<int> comp);
+    bool convergable_block(uint64_t block, const std::vector<int>& comp);
     uint64_t block_hash(uint64_t addr);
+    uint64_t function_hash(uint64_t func);
+    uint64_t block_label(uint64_t addr);
 };
 
 #endif // CLUSTERMANAGER_H
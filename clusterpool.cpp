@@ -0,0 +1,72 @@
+#include "clusterpool.h"
+
+#include "uc_inst.h"
+
+ClusterPool::ClusterPool(int num_workers, size_t max_queued, uint64_t job_mem) : max_queued(max_queued), job_mem(job_mem)
+{
+    if (num_workers < 1)
+        num_workers = 1;
+    if (this->max_queued < 1)
+        this->max_queued = 1;
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        threads.push_back(std::thread(&ClusterPool::work, this));
+    }
+}
+
+ClusterPool::~ClusterPool()
+{
+    join();
+}
+
+void ClusterPool::submit(std::function<void()> job)
+{
+    // Jobs reserve their own memory once they run, this only holds off
+    // queueing more while the budget couldn't take them
+    uc_res_wait_room(job_mem);
+    
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        has_room.wait(guard, [this] { return jobs.size() < max_queued; });
+        jobs.push_back(job);
+    }
+    has_jobs.notify_one();
+}
+
+void ClusterPool::work()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            has_jobs.wait(guard, [this] { return stopping || !jobs.empty(); });
+            
+            // Drain the queue before honoring a stop
+            if (jobs.empty()) return;
+            
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        has_room.notify_one();
+        
+        job();
+    }
+}
+
+void ClusterPool::join()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    has_jobs.notify_all();
+    
+    for (auto& t : threads)
+    {
+        if (t.joinable())
+            t.join();
+    }
+    threads.clear();
+}
@@ -0,0 +1,39 @@
+#ifndef CLUSTERPOOL_H
+#define CLUSTERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Runs cluster jobs on a fixed set of threads. submit() blocks while the
+// queue is full or the memory budget has no room for another job's worth,
+// so the producer can't get far ahead of the workers, and join() waits for
+// everything submitted so far to finish.
+class ClusterPool
+{
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()> > jobs;
+    size_t max_queued;
+    uint64_t job_mem;
+    
+    std::mutex lock;
+    std::condition_variable has_jobs;
+    std::condition_variable has_room;
+    bool stopping = false;
+
+    void work();
+
+public:
+    ClusterPool(int num_workers, size_t max_queued, uint64_t job_mem);
+    ~ClusterPool();
+    
+    void submit(std::function<void()> job);
+    void join();
+};
+
+#endif // CLUSTERPOOL_H
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Emulates an NRO once with block-granular slices and once with --single-step,
+# then diffs the token (.txt) and transpiled (.lc) output of the two runs.
+# Runs on a single cluster thread so hash tracing is deterministic. Any extra
+# arguments are passed to both runs.
+#
+# Usage: ./compare_slices.sh <lua2cpp_char.nro> [options...]
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <lua2cpp_char.nro> [options...]"
+    exit 1
+fi
+
+nro="$1"
+shift
+
+bin="$(dirname "$0")/nrooooooo"
+out="$(mktemp -d)"
+trap 'rm -rf "$out"' EXIT
+
+"$bin" "$nro" "$out/blocks" --no-snapshot --cluster-threads 1 "$@" > "$out/blocks.log"
+"$bin" "$nro" "$out/single" --no-snapshot --cluster-threads 1 --single-step "$@" > "$out/single.log"
+
+if diff -r "$out/blocks" "$out/single"; then
+    echo "Block slices match --single-step for $nro"
+else
+    echo "Block slices differ from --single-step for $nro"
+    exit 1
+fi
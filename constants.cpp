@@ -7,9 +7,9 @@
 #include <filesystem>
 #include <useful.h>
 
-std::set<uint32_t> last_crcs;
 std::map<uint64_t, std::string> unhash;
 std::map<uint32_t, std::string> unhash_parts;
+std::mutex unhash_lock;
 std::map<uint64_t, std::string> status_funcs;
 
 std::map<std::string, std::vector<std::string> > character_objects;
@@ -1737,6 +1737,15 @@ void init_character_objects()
 std::vector<int> const_value_table_values;
 std::vector<std::string> const_value_table;
 
+// Empty if the hash isn't known
+std::string unhash_find(uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(unhash_lock);
+
+    auto iter = unhash.find(hash);
+    return iter != unhash.end() ? iter->second : "";
+}
+
 void init_const_value_table() {
     // Load in const value table
     std::ifstream const_value_lines("const_value_table_with_values_810.csv");
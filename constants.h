@@ -2,13 +2,16 @@
 #define CONSTANTS_H
 
 #include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <set>
 
-extern std::set<uint32_t> last_crcs;
+// Hash tracing adds to unhash and unhash_parts while clusters run, anything
+// touching them after startup holds unhash_lock or goes through unhash_find
 extern std::map<uint64_t, std::string> unhash;
 extern std::map<uint32_t, std::string> unhash_parts;
+extern std::mutex unhash_lock;
 extern std::map<uint64_t, std::string> status_funcs;
 
 extern std::map<std::string, std::vector<std::string> > character_objects;
@@ -19,6 +22,8 @@ extern std::string fighter_status_kind[0x1A7];
 extern std::vector<int> const_value_table_values;
 extern std::vector<std::string> const_value_table;
 
+std::string unhash_find(uint64_t hash);
+
 void init_character_objects();
 void init_const_value_table();
 
@@ -0,0 +1,162 @@
+#include "emuengine.h"
+
+#include "clustermanager.h"
+#include "crc32.h"
+
+EmuEngine::EmuEngine(ClusterManager* cluster) : cluster(cluster), nro_mem(cluster->get_nro_mem()), import_mem(cluster->get_import_mem())
+{
+    uc_err err;
+    uc_hook trace2, trace3;
+
+    err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
+    if (err) {
+        printf_error("Cluster %u: Failed on uc_open() with error returned: %u (%s)\n",
+                cluster->get_id(), err, uc_strerror(err));
+        return;
+    }
+    
+    uint32_t x;
+    uc_reg_read(uc, UC_ARM64_REG_CPACR_EL1, &x);
+    x |= 0x300000; // set FPEN bit
+    uc_reg_write(uc, UC_ARM64_REG_CPACR_EL1, &x);
+
+    // import hooks, one over all of IMPORTS since hook_import ignores
+    // anything that isn't a bound stub
+    uc_hook trace;
+    uc_hook_add(uc, &trace, UC_HOOK_CODE, (void*)hook_import, this, IMPORTS, IMPORTS_END - 1);
+    
+    for (auto addr : cluster->get_code_hooks())
+    {
+        add_code_hook(addr);
+    }
+    
+    uc_hook_add(uc, &trace2, UC_HOOK_MEM_UNMAPPED, (void*)hook_mem_invalid, this, 1, 0);
+    
+    // Hash recovery only cares about CRC32 table lookups and words read off the stack
+    if (hash_tracing)
+    {
+        auto table = unresolved_syms.find("phx::detail::CRC32Table::table_");
+        if (table != unresolved_syms.end())
+        {
+            crc_table = table->second;
+            uc_hook_add(uc, &trace3, UC_HOOK_MEM_READ, (void*)hook_crc_read, this, crc_table, crc_table + sizeof(crc32_tab) - 1);
+        }
+
+        uc_hook_add(uc, &trace3, UC_HOOK_MEM_READ, (void*)hook_stack_read, this, STACK, STACK_END);
+    }
+    
+    // Hooking all of memory sends every load and store down the slow path,
+    // so that only happens when accesses are actually being logged
+    if (logmask_is_set(LOGMASK_VERBOSE))
+        uc_hook_add(uc, &trace3, UC_HOOK_MEM_WRITE | UC_HOOK_MEM_READ, (void*)hook_memrw, this, 1, 0);
+    else
+        uc_hook_add(uc, &trace3, UC_HOOK_MEM_WRITE, (void*)hook_memrw, this, IMPORTS, IMPORTS_END - 1);
+    
+    uc_mem_map_ptr(uc, NRO, NRO_SIZE, UC_PROT_ALL, nro_mem);
+    uc_mem_map_ptr(uc, IMPORTS, IMPORTS_SIZE, UC_PROT_ALL, import_mem);
+    
+    if (uc_context_alloc(uc, &initial_ctx) == UC_ERR_OK)
+        uc_context_save(uc, initial_ctx);
+}
+
+EmuEngine::~EmuEngine()
+{
+    unmap_inst_mem(mapped_heap, mapped_stack);
+
+    uc_mem_unmap(uc, IMPORTS, IMPORTS_SIZE);
+    uc_mem_unmap(uc, NRO, NRO_SIZE);
+    
+    if (initial_ctx)
+        uc_free(initial_ctx);
+    uc_close(uc);
+    
+    if (owns_mem)
+    {
+        image_release(import_mem, IMPORTS_SIZE, mem_mapped);
+        image_release(nro_mem, NRO_SIZE, mem_mapped);
+    }
+}
+
+// Hands a detached engine to a new cluster. NRO and IMPORTS stay mapped at the
+// same host memory, which the cluster refills, so translated code is kept.
+void EmuEngine::attach(ClusterManager* cluster)
+{
+    this->cluster = cluster;
+    owns_mem = false;
+    running = nullptr;
+    
+    unmap_inst_mem(mapped_heap, mapped_stack);
+    
+    if (initial_ctx)
+        uc_context_restore(uc, initial_ctx);
+    regs_stale();
+}
+
+void EmuEngine::add_code_hook(uint64_t addr)
+{
+    uc_hook trace;
+    uc_hook_add(uc, &trace, UC_HOOK_CODE, (void*)hook_import, this, addr, addr);
+}
+
+// HEAP and STACK stay mapped between slices, they only get swapped when
+// the running instance's memory actually differs from what is mapped.
+void EmuEngine::map_inst_mem(void* heap, void* stack)
+{
+    if (heap != mapped_heap)
+    {
+        if (mapped_heap)
+            uc_mem_unmap(uc, HEAP, HEAP_SIZE);
+        uc_mem_map_ptr(uc, HEAP, HEAP_SIZE, UC_PROT_ALL, heap);
+        mapped_heap = heap;
+    }
+    
+    if (stack != mapped_stack)
+    {
+        if (mapped_stack)
+            uc_mem_unmap(uc, STACK, STACK_SIZE);
+        uc_mem_map_ptr(uc, STACK, STACK_SIZE, UC_PROT_ALL, stack);
+        mapped_stack = stack;
+    }
+    
+    cluster->count_slice();
+}
+
+// Called before instance memory is freed or moves engines so nothing stale stays mapped
+void EmuEngine::unmap_inst_mem(void* heap, void* stack)
+{
+    if (heap && heap == mapped_heap)
+    {
+        uc_mem_unmap(uc, HEAP, HEAP_SIZE);
+        mapped_heap = nullptr;
+    }
+    
+    if (stack && stack == mapped_stack)
+    {
+        uc_mem_unmap(uc, STACK, STACK_SIZE);
+        mapped_stack = nullptr;
+    }
+}
+
+void EmuEngine::regs_flush(uc_reg_state* regs)
+{
+    if (!uc_regs_valid)
+    {
+        uc_write_reg_state(uc, regs);
+        uc_regs = *regs;
+        uc_regs_valid = true;
+        return;
+    }
+
+    uc_sync_reg_state(uc, regs, &uc_regs);
+}
+
+void EmuEngine::regs_invalidate(uc_reg_state* regs)
+{
+    if (!uc_regs_valid)
+    {
+        uc_read_reg_state(uc, &uc_regs);
+        uc_regs_valid = true;
+    }
+
+    *regs = uc_regs;
+}
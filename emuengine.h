@@ -0,0 +1,102 @@
+#ifndef EMUENGINE_H
+#define EMUENGINE_H
+
+#include <stdint.h>
+#include "uc_impl.h"
+
+class ClusterManager;
+class EmuInstance;
+
+// A Unicorn engine with a cluster's NRO and imports mapped in. Instances of
+// the same cluster can run on different engines, one instance at a time each.
+class EmuEngine
+{
+private:
+    ClusterManager* cluster;
+    uc_engine* uc;
+    EmuInstance* running = nullptr;
+    void* mapped_heap = nullptr;
+    void* mapped_stack = nullptr;
+    void* nro_mem;
+    void* import_mem;
+    bool owns_mem = false;
+    bool mem_mapped = false;
+    uint64_t crc_table = 0;
+    
+    // Register context straight after setup, restored when the engine is reused
+    uc_context* initial_ctx = nullptr;
+    
+    // What the engine's registers currently hold, if known
+    uc_reg_state uc_regs;
+    bool uc_regs_valid = false;
+
+public:
+    EmuEngine(ClusterManager* cluster);
+    ~EmuEngine();
+    
+    ClusterManager* get_cluster()
+    {
+        return cluster;
+    }
+    
+    uc_engine* get_uc()
+    {
+        return uc;
+    }
+    
+    uint64_t get_crc_table()
+    {
+        return crc_table;
+    }
+    
+    void* get_nro_mem()
+    {
+        return nro_mem;
+    }
+    
+    void* get_import_mem()
+    {
+        return import_mem;
+    }
+    
+    bool get_mem_mapped()
+    {
+        return mem_mapped;
+    }
+    
+    // A detached engine keeps its NRO and IMPORTS memory alive until
+    // it is attached to another cluster or deleted
+    void detach(bool mapped)
+    {
+        owns_mem = true;
+        mem_mapped = mapped;
+        running = nullptr;
+    }
+    
+    void attach(ClusterManager* cluster);
+    
+    void set_running_inst(EmuInstance* inst)
+    {
+        running = inst;
+    }
+    
+    EmuInstance* get_running_inst()
+    {
+        return running;
+    }
+    
+    void add_code_hook(uint64_t addr);
+    void map_inst_mem(void* heap, void* stack);
+    void unmap_inst_mem(void* heap, void* stack);
+    
+    void regs_flush(uc_reg_state* regs);
+    void regs_invalidate(uc_reg_state* regs);
+    
+    // Anything which lets the guest run has to call this afterwards
+    void regs_stale()
+    {
+        uc_regs_valid = false;
+    }
+};
+
+#endif // EMUENGINE_H
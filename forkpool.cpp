@@ -0,0 +1,195 @@
+#include "forkpool.h"
+
+#include "clustermanager.h"
+
+#include <algorithm>
+#include <thread>
+
+ForkPool::ForkPool(ClusterManager* cluster, int num_workers, bool breadth_first) : cluster(cluster), root(nullptr), breadth_first(breadth_first)
+{
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+}
+
+void ForkPool::run(EmuInstance* root)
+{
+    this->root = root;
+
+    for (auto fork : queue_order(root->take_forks()))
+    {
+        if (!fork->is_term() && !fork->get_start_addr() && !fork->get_div_branch())
+            printf_warn("Instance Id %u: Fork Instance Id %u never finished diverge tests!\n", root->get_id(), fork->get_id());
+
+        hand_off(0, root, fork);
+    }
+    
+    // The calling thread works too, on the root's engine
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        threads.push_back(std::thread(&ForkPool::work, this, i, cluster->get_fork_engine(i - 1)));
+    }
+    
+    work(0, root->get_engine());
+    
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    
+    root->regs_flush();
+}
+
+// Forks get queued so that they're taken in the order they were created
+std::vector<EmuInstance*> ForkPool::queue_order(std::vector<EmuInstance*> forks)
+{
+    if (!breadth_first)
+        std::reverse(forks.begin(), forks.end());
+
+    return forks;
+}
+
+void ForkPool::hand_off(int worker, EmuInstance* parent, EmuInstance* fork)
+{
+    // A lone worker runs forks one at a time, so they can keep sharing the heap
+    if (workers.size() > 1)
+        fork->own_heap();
+
+    {
+        std::lock_guard<std::mutex> lock(retire_lock);
+        live_children[parent]++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workers[worker]->lock);
+        workers[worker]->queue.push_back(fork);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        queued++;
+        outstanding++;
+    }
+    work_cond.notify_one();
+}
+
+EmuInstance* ForkPool::take(int worker)
+{
+    EmuInstance* fork = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(workers[worker]->lock);
+        auto& queue = workers[worker]->queue;
+        if (queue.size() && breadth_first)
+        {
+            fork = queue.front();
+            queue.pop_front();
+        }
+        else if (queue.size())
+        {
+            fork = queue.back();
+            queue.pop_back();
+        }
+    }
+    
+    for (size_t i = 1; !fork && i < workers.size(); i++)
+    {
+        Worker* victim = workers[(worker + i) % workers.size()].get();
+
+        std::lock_guard<std::mutex> lock(victim->lock);
+        if (victim->queue.size())
+        {
+            fork = victim->queue.front();
+            victim->queue.pop_front();
+        }
+    }
+    
+    if (fork)
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        queued--;
+    }
+    
+    return fork;
+}
+
+void ForkPool::work(int worker, EmuEngine* engine)
+{
+    while (true)
+    {
+        EmuInstance* fork = take(worker);
+        if (fork)
+        {
+            run_fork(worker, engine, fork);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(work_lock);
+        work_cond.wait(lock, [this] { return queued || !outstanding; });
+
+        if (!outstanding) break;
+    }
+}
+
+void ForkPool::run_fork(int worker, EmuEngine* engine, EmuInstance* fork)
+{
+    fork->move_to_engine(engine);
+    
+    uc_err err = UC_ERR_OK;
+    while (!err && !fork->is_term())
+    {
+        err = fork->uc_run_slice();
+    }
+
+    // Nothing else will run on this engine's mapping of the fork
+    fork->move_to_engine(nullptr);
+
+    for (auto child : queue_order(fork->take_forks()))
+    {
+        if (!child->is_term() && !child->get_start_addr() && !child->get_div_branch())
+            printf_warn("Instance Id %u: Fork Instance Id %u never finished diverge tests!\n", fork->get_id(), child->get_id());
+
+        child->move_to_engine(nullptr);
+        hand_off(worker, fork, child);
+    }
+    
+    retire(fork);
+
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        outstanding--;
+    }
+    work_cond.notify_all();
+}
+
+void ForkPool::retire(EmuInstance* fork)
+{
+    std::vector<EmuInstance*> to_delete;
+
+    {
+        std::lock_guard<std::mutex> lock(retire_lock);
+        
+        finished[fork] = true;
+
+        EmuInstance* iter = fork;
+        while (iter && iter != root && finished[iter] && !live_children[iter])
+        {
+            EmuInstance* parent = iter->get_parent();
+            
+            finished.erase(iter);
+            live_children.erase(iter);
+            to_delete.push_back(iter);
+
+            if (parent)
+                live_children[parent]--;
+            iter = parent;
+        }
+    }
+    
+    for (auto inst : to_delete)
+    {
+        delete inst;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef FORKPOOL_H
+#define FORKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class ClusterManager;
+class EmuInstance;
+class EmuEngine;
+
+// Schedules the diverged forks of an instance until all of them complete.
+// Each worker has its own engine and deque; workers take the newest fork
+// (depth-first) or oldest fork (breadth-first) from their own deque and
+// steal the oldest from others when they run dry.
+class ForkPool
+{
+private:
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<EmuInstance*> queue;
+    };
+
+    ClusterManager* cluster;
+    EmuInstance* root;
+    bool breadth_first;
+    std::vector<std::unique_ptr<Worker> > workers;
+    
+    std::mutex work_lock;
+    std::condition_variable work_cond;
+    int queued = 0;
+    int outstanding = 0;
+    
+    // Forks stay alive until all of their own forks finish, since
+    // the fork hierarchy is built by walking parents
+    std::mutex retire_lock;
+    std::map<EmuInstance*, int> live_children;
+    std::map<EmuInstance*, bool> finished;
+
+    std::vector<EmuInstance*> queue_order(std::vector<EmuInstance*> forks);
+    void hand_off(int worker, EmuInstance* parent, EmuInstance* fork);
+    EmuInstance* take(int worker);
+    void work(int worker, EmuEngine* engine);
+    void run_fork(int worker, EmuEngine* engine, EmuInstance* fork);
+    void retire(EmuInstance* fork);
+
+public:
+    ForkPool(ClusterManager* cluster, int num_workers, bool breadth_first = false);
+    
+    void run(EmuInstance* root);
+};
+
+#endif // FORKPOOL_H
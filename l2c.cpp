@@ -4,6 +4,66 @@
 #include "main.h"
 #include "clustermanager.h"
 
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+// Function-local so tokens can be made during static initialization
+struct L2C_Interned
+{
+    std::mutex lock;
+    std::deque<std::string> names = {"", "BLOCK_MERGE", "CONV", "DIV_FALSE", "DIV_TRUE", "NORETURN", "SPLIT_BLOCK_MERGE", "SUB_BRANCH", "SUB_GOTO", "SUB_RET"};
+    std::unordered_map<std::string, uint32_t> ids;
+    
+    L2C_Interned()
+    {
+        for (uint32_t i = 0; i < L2C_TokenSym_Max; i++)
+            ids[names[i]] = i;
+    }
+};
+
+static L2C_Interned& interned()
+{
+    static L2C_Interned table;
+    return table;
+}
+
+uint32_t l2c_intern(const std::string& name)
+{
+    L2C_Interned& table = interned();
+    std::lock_guard<std::mutex> lock(table.lock);
+
+    auto iter = table.ids.find(name);
+    if (iter != table.ids.end()) return iter->second;
+    
+    uint32_t sym = table.names.size();
+    table.names.push_back(name);
+    table.ids[name] = sym;
+
+    return sym;
+}
+
+// Names are only interned during setup, before any cluster runs, and deque
+// elements never move, so reads don't need the lock
+const std::string& l2c_sym_name(uint32_t sym)
+{
+    return interned().names[sym];
+}
+
+uint32_t l2c_intern_count()
+{
+    L2C_Interned& table = interned();
+    std::lock_guard<std::mutex> lock(table.lock);
+
+    return table.names.size();
+}
+
+const std::vector<int>* l2c_empty_hierarchy()
+{
+    static const std::vector<int> empty;
+    return &empty;
+}
+
 std::string L2C_Token::to_string(ClusterManager* cluster, uint64_t rel) const
 {
     char tmp[1024];
@@ -15,19 +75,19 @@ std::string L2C_Token::to_string(ClusterManager* cluster, uint64_t rel) const
 
     //printf("%s%" PRIx64 " ", (rel ? "+" : ""), pc - rel);
     //if (rel)
-    //    printf("b:%" PRIx64 "", cluster->block_hash(rel));
+    //    printf("b:%" PRIx64 "", cluster->block_label(rel));
     //out += (rel ? "+" : "");
     snprintf(tmp, 1024, "%" PRIx64 " ", pc);
     out += std::string(tmp);
 
     //printf("%s", fork_hierarchy_str().c_str());
-    out += " " + str;
+    out += " " + name();
 
     if (args.size())
         out += " args ";
 
     bool is_exit = false;
-    if (str == "SUB_BRANCH" || str == "SUB_GOTO" || str == "DIV_FALSE" || str == "DIV_TRUE" || str == "CONV" || str == "BLOCK_MERGE" || str == "SPLIT_BLOCK_MERGE")
+    if (sym == L2C_TokenSym_SubBranch || sym == L2C_TokenSym_SubGoto || sym == L2C_TokenSym_DivFalse || sym == L2C_TokenSym_DivTrue || sym == L2C_TokenSym_Conv || sym == L2C_TokenSym_BlockMerge || sym == L2C_TokenSym_SplitBlockMerge)
         is_exit = true;
 
     for (size_t i = 0; i < args.size(); i++)
@@ -46,7 +106,7 @@ std::string L2C_Token::to_string(ClusterManager* cluster, uint64_t rel) const
             snprintf(tmp, 1024, "%s0x%" PRIx64 "", (neg ? "-" : "+"), val);*/
             
             // Hash
-            snprintf(tmp, 1024, "b:%" PRIx64 "", cluster->block_hash(args[i]));
+            snprintf(tmp, 1024, "b:%" PRIx64 "", cluster->block_label(args[i]));
             out += std::string(tmp);
         }
         else
@@ -54,8 +114,9 @@ std::string L2C_Token::to_string(ClusterManager* cluster, uint64_t rel) const
             snprintf(tmp, 1024, "0x%" PRIx64 "", args[i]);
             out += std::string(tmp);
             
-            if (unhash[args[i]] != "")
-                out += " (" + unhash[args[i]] + ")";
+            std::string unhashed = unhash_find(args[i]);
+            if (unhashed != "")
+                out += " (" + unhashed + ")";
             for (auto j : arg_is_const_value) {
                 if (arg_is_const_value[j] == i) {
                     out += " (" + const_value_table[args[i]] + ")";
@@ -82,7 +143,7 @@ std::string L2C_Token::to_string(ClusterManager* cluster, uint64_t rel) const
     return out;
 }
 
-void L2C_Token::to_file(ClusterManager* cluster, uint64_t rel, std::ofstream& file) const
+void L2C_Token::to_file(ClusterManager* cluster, uint64_t rel, std::ostream& file) const
 {
     char tmp[1024];
     std::string out = "";
@@ -95,13 +156,13 @@ void L2C_Token::to_file(ClusterManager* cluster, uint64_t rel, std::ofstream& fi
     file << std::string(tmp);
 
     //printf("%s", fork_hierarchy_str().c_str());
-    file << " " + str;
+    file << " " + name();
 
     if (args.size())
         file << " args ";
 
     bool is_exit = false;
-    if (str == "SUB_BRANCH" || str == "SUB_GOTO" || str == "DIV_FALSE" || str == "DIV_TRUE" || str == "CONV" || str == "BLOCK_MERGE" || str == "SPLIT_BLOCK_MERGE")
+    if (sym == L2C_TokenSym_SubBranch || sym == L2C_TokenSym_SubGoto || sym == L2C_TokenSym_DivFalse || sym == L2C_TokenSym_DivTrue || sym == L2C_TokenSym_Conv || sym == L2C_TokenSym_BlockMerge || sym == L2C_TokenSym_SplitBlockMerge)
         is_exit = true;
 
     for (size_t i = 0; i < args.size(); i++)
@@ -120,7 +181,7 @@ void L2C_Token::to_file(ClusterManager* cluster, uint64_t rel, std::ofstream& fi
             snprintf(tmp, 1024, "%s0x%" PRIx64 "", (neg ? "-" : "+"), val);*/
             
             // Hash
-            snprintf(tmp, 1024, "b:%" PRIx64 "", cluster->block_hash(args[i]));
+            snprintf(tmp, 1024, "b:%" PRIx64 "", cluster->block_label(args[i]));
             file << std::string(tmp);
         }
         else
@@ -128,8 +189,9 @@ void L2C_Token::to_file(ClusterManager* cluster, uint64_t rel, std::ofstream& fi
             snprintf(tmp, 1024, "0x%" PRIx64 "", args[i]);
             file << std::string(tmp);
             
-            if (unhash[args[i]] != "")
-                file << " (" + unhash[args[i]] + ")";
+            std::string unhashed = unhash_find(args[i]);
+            if (unhashed != "")
+                file << " (" + unhashed + ")";
             for (auto j : arg_is_const_value) {
                 if (arg_is_const_value[j] == i) {
                     file << " (" + const_value_table[args[i]] + ")";
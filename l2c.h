@@ -1,6 +1,8 @@
 #ifndef L2C_H
 #define L2C_H
 
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 #include <map>
 #include <set>
@@ -8,6 +10,7 @@
 
 #include "useful.h"
 #include "crc32.h"
+#include "arena.h"
 
 struct L2CValue;
 struct L2C_Token;
@@ -26,17 +29,164 @@ enum L2C_TokenType
     L2C_TokenType_Meta = 3,
 };
 
+// Token names are interned, the meta and branch names have fixed ids in
+// alphabetical order so tokens still sort the way they did as strings
+enum L2C_TokenSym
+{
+    L2C_TokenSym_None = 0,
+    L2C_TokenSym_BlockMerge,
+    L2C_TokenSym_Conv,
+    L2C_TokenSym_DivFalse,
+    L2C_TokenSym_DivTrue,
+    L2C_TokenSym_Noreturn,
+    L2C_TokenSym_SplitBlockMerge,
+    L2C_TokenSym_SubBranch,
+    L2C_TokenSym_SubGoto,
+    L2C_TokenSym_SubRet,
+    L2C_TokenSym_Max,
+};
+
+uint32_t l2c_intern(const std::string& name);
+const std::string& l2c_sym_name(uint32_t sym);
+uint32_t l2c_intern_count();
+const std::vector<int>* l2c_empty_hierarchy();
+
+// Fork hierarchies are interned per cluster, see intern_hierarchy. Equal
+// ones share storage so they compare by pointer.
+class L2C_ForkHierarchy
+{
+private:
+    const std::vector<int>* ids;
+
+public:
+    L2C_ForkHierarchy() : ids(l2c_empty_hierarchy()) {}
+    explicit L2C_ForkHierarchy(const std::vector<int>* ids) : ids(ids) {}
+    
+    size_t size() const
+    {
+        return ids->size();
+    }
+
+    int operator[](size_t idx) const
+    {
+        return (*ids)[idx];
+    }
+    
+    const std::vector<int>& vec() const
+    {
+        return *ids;
+    }
+    
+    bool operator==(const L2C_ForkHierarchy& comp) const
+    {
+        return ids == comp.ids;
+    }
+
+    bool operator!=(const L2C_ForkHierarchy& comp) const
+    {
+        return ids != comp.ids;
+    }
+
+    bool operator<(const L2C_ForkHierarchy& comp) const
+    {
+        if (ids == comp.ids) return false;
+        
+        return *ids < *comp.ids;
+    }
+};
+
+// Token arguments rarely go past a few values, so those are kept inline
+template <typename T, size_t N>
+class L2C_SmallVec
+{
+private:
+    T inline_vals[N] = {};
+    size_t count = 0;
+    std::vector<T> spill;
+
+public:
+    size_t size() const
+    {
+        return count;
+    }
+    
+    T* begin()
+    {
+        return count > N ? spill.data() : inline_vals;
+    }
+    
+    T* end()
+    {
+        return begin() + count;
+    }
+
+    const T* begin() const
+    {
+        return count > N ? spill.data() : inline_vals;
+    }
+    
+    const T* end() const
+    {
+        return begin() + count;
+    }
+    
+    T& operator[](size_t idx)
+    {
+        return begin()[idx];
+    }
+    
+    const T& operator[](size_t idx) const
+    {
+        return begin()[idx];
+    }
+
+    void push_back(const T& val)
+    {
+        if (count < N)
+        {
+            inline_vals[count++] = val;
+            return;
+        }
+        
+        if (count == N)
+            spill.assign(inline_vals, inline_vals + N);
+
+        spill.push_back(val);
+        count++;
+    }
+    
+    void clear()
+    {
+        count = 0;
+        spill.clear();
+    }
+    
+    bool operator==(const L2C_SmallVec& comp) const
+    {
+        return count == comp.count && std::equal(begin(), end(), comp.begin());
+    }
+    
+    bool operator<(const L2C_SmallVec& comp) const
+    {
+        return std::lexicographical_compare(begin(), end(), comp.begin(), comp.end());
+    }
+};
+
 struct L2C_Token
 {
     uint64_t pc;
-    std::vector<int> fork_hierarchy;
-    std::string str;
+    L2C_ForkHierarchy fork_hierarchy;
+    uint32_t sym;
     L2C_TokenType type;
-    std::vector<uint64_t> args;
-    std::vector<size_t> arg_is_const_value;
-    std::vector<float> fargs;
+    L2C_SmallVec<uint64_t, 4> args;
+    L2C_SmallVec<size_t, 2> arg_is_const_value;
+    L2C_SmallVec<float, 2> fargs;
+    
+    // Generation of the block holding it, not part of the ordering so it
+    // can be stamped once the token is already in a set
+    mutable uint32_t gen;
     
-    L2C_Token() : pc(0), fork_hierarchy(), str(""), type(L2C_TokenType_Invalid), args(), fargs() {}
+    L2C_Token() : pc(0), fork_hierarchy(), sym(L2C_TokenSym_None), type(L2C_TokenType_Invalid), args(), fargs(), gen(0) {}
     
     bool operator<(const L2C_Token& comp) const
     {
@@ -46,7 +196,7 @@ struct L2C_Token
             {
                 if (type == comp.type)
                 {
-                    if (str == comp.str)
+                    if (sym == comp.sym)
                     {
                         if (args == comp.args)
                         {
@@ -55,7 +205,7 @@ struct L2C_Token
                         
                         return args < comp.args;
                     }
-                    return str < comp.str;
+                    return sym < comp.sym;
                 }
                 
                 return type < comp.type;
@@ -67,6 +217,17 @@ struct L2C_Token
         return pc < comp.pc;
     }
     
+    const std::string& name() const
+    {
+        return l2c_sym_name(sym);
+    }
+    
+    // Tokens whose first arg is the address of another block
+    bool is_edge() const
+    {
+        return sym == L2C_TokenSym_SubBranch || sym == L2C_TokenSym_SubGoto || sym == L2C_TokenSym_DivFalse || sym == L2C_TokenSym_DivTrue || sym == L2C_TokenSym_Conv || sym == L2C_TokenSym_BlockMerge || sym == L2C_TokenSym_SplitBlockMerge;
+    }
+    
     std::string fork_hierarchy_str() const
     {
         std::string out = "";
@@ -82,7 +243,7 @@ struct L2C_Token
     }
     
     std::string to_string(ClusterManager* cluster, uint64_t rel = 0) const;
-    void to_file(ClusterManager* cluster, uint64_t rel, std::ofstream& file) const;
+    void to_file(ClusterManager* cluster, uint64_t rel, std::ostream& file) const;
 };
 
 enum L2C_CodeBlockType
@@ -99,9 +260,10 @@ struct L2C_CodeBlock
     uint64_t addr_end;
     L2C_CodeBlockType type;
     std::vector<int> fork_hierarchy;
+    uint32_t gen;
 
-    L2C_CodeBlock() : addr(0), addr_end(0), type(L2C_CodeBlockType_Invalid) {}
-    L2C_CodeBlock(uint64_t addr, L2C_CodeBlockType type, std::vector<int> fork_hierarchy) : addr(addr), addr_end(addr), type(type), fork_hierarchy(fork_hierarchy) {}
+    L2C_CodeBlock() : addr(0), addr_end(0), type(L2C_CodeBlockType_Invalid), gen(0) {}
+    L2C_CodeBlock(uint64_t addr, L2C_CodeBlockType type, std::vector<int> fork_hierarchy) : addr(addr), addr_end(addr), type(type), fork_hierarchy(fork_hierarchy), gen(0) {}
     
     uint64_t size()
     {
@@ -152,6 +314,11 @@ struct L2C_CodeBlock
     }
 };
 
+// Per-function analysis state, allocated from its cluster's arena
+typedef ArenaSet<L2C_Token> L2C_TokenSet;
+typedef ArenaMap<uint64_t, L2C_TokenSet> L2C_TokenMap;
+typedef ArenaMap<uint64_t, L2C_CodeBlock> L2C_BlockMap;
+
 enum L2CVarType
 {
     L2C_void = 0,
@@ -12,13 +12,13 @@ class LuaTranspiler
 {
 private:
     std::string path;
-    std::map<uint64_t, std::set<L2C_Token> > tokens;
+    const L2C_TokenMap& tokens;
     uint64_t func;
     
     LuaBytecodeEmitter emitter;
 
 public:
-    LuaTranspiler(std::string path, std::map<uint64_t, std::set<L2C_Token> > tokens, uint64_t func) : path(path), tokens(tokens), func(func), emitter(path) 
+    LuaTranspiler(std::string path, const L2C_TokenMap& tokens, uint64_t func) : path(path), tokens(tokens), func(func), emitter(path) 
     {
         emitter.EmitLuacHeader();
         emitter.BeginFunction(0, 0, 0, 1, 2);
@@ -4,8 +4,10 @@
 #include <time.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <list>
+#include <memory>
 #include <algorithm>
 #include <atomic>
 #include <chrono>
@@ -18,13 +20,15 @@
 #include "logging.h"
 #include "constants.h"
 #include "clustermanager.h"
+#include "clusterpool.h"
 #include "eh.h"
 #include "lua_transpile.h"
+#include "snapshot.h"
 #include <useful.h>
 
-#define MAX_CLUSTERS_ACTIVE 100
+// Jobs queued ahead of the cluster workers
+#define CLUSTER_QUEUE_PER_WORKER 2
 
-std::atomic<int> clusters_active = 0;
 int imports_size = 0;
 std::map<std::string, uint64_t> unresolved_syms;
 std::map<uint64_t, std::string> unresolved_syms_rev;
@@ -37,6 +41,16 @@ std::map<uint64_t, std::string> l2cagents_rev;
 
 bool syms_scanned = false;
 bool trace_code = true;
+bool slow_block_slices = true;
+int fork_threads = 1;
+bool fork_breadth_first = false;
+bool hash_tracing = true;
+int cluster_threads = 0;
+bool use_snapshot = true;
+
+// Each cluster worker hands its engine from one function to the next,
+// so NRO code translated for earlier functions stays warm
+thread_local std::unique_ptr<EmuEngine> worker_engine;
 
 struct nso_header
 {
@@ -54,6 +68,22 @@ struct mod0_header
     int32_t unwind_end;
 };
 
+// Guest address each dynamic symbol relocates to, by symbol index. Zero for
+// symbols which don't demangle, relocations against those are left alone.
+static std::vector<uint64_t> sym_addrs;
+
+static void demangle_syms(const Elf64_Sym* symtab, const char* strtab, std::vector<std::string>* names, size_t start, size_t end)
+{
+    for (size_t i = start; i < end; i++)
+    {
+        char* demangled = abi::__cxa_demangle(strtab + symtab[i].st_name, 0, 0, 0);
+        if (!demangled) continue;
+        
+        (*names)[i] = std::string(demangled);
+        free(demangled);
+    }
+}
+
 void nro_assignsyms(void* base)
 {
     const Elf64_Dyn* dyn = NULL;
@@ -84,16 +114,32 @@ void nro_assignsyms(void* base)
     
     numsyms = ((uintptr_t)strtab - (uintptr_t)symtab) / sizeof(Elf64_Sym);
     
+    // Demangling is most of the startup time on big NROs, and each name
+    // is independent. Names get assigned in index order afterwards so the
+    // IMPORTS layout doesn't change.
+    std::vector<std::string> names(numsyms);
+    std::vector<std::thread> threads;
+    size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t per_thread = (numsyms + num_threads - 1) / num_threads;
+    for (size_t start = 0; start < numsyms; start += per_thread)
+    {
+        threads.push_back(std::thread(demangle_syms, symtab, strtab, &names, start, std::min<size_t>(start + per_thread, numsyms)));
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    
     for (uint64_t i = 0; i < numsyms; i++)
     {
-        char* demangled = abi::__cxa_demangle(strtab + symtab[i].st_name, 0, 0, 0);
+        const std::string& demangled_str = names[i];
+        bool demangled = !demangled_str.empty();
 
         if (symtab[i].st_shndx == 0 && demangled)
         {
             //TODO: just read the main NSO for types/sizes? Or have them resolve to the main NSO
 
             uint64_t import_size = 0x8;
-            std::string demangled_str = std::string(demangled);
             if (demangled_str == "phx::detail::CRC32Table::table_")
             {
                 import_size = sizeof(crc32_tab);
@@ -102,7 +148,7 @@ void nro_assignsyms(void* base)
             {
                 import_size = 0x10;
             }
-            else if (!strncmp(demangled, "`vtable for'", 12))
+            else if (!strncmp(demangled_str.c_str(), "`vtable for'", 12))
             {
                 import_size = 0x1000;
             }
@@ -115,21 +161,36 @@ void nro_assignsyms(void* base)
             }
             
             uint64_t addr = IMPORTS + (imports_size + import_size);
-            unresolved_syms[std::string(demangled_str)] = addr;
-            unresolved_syms_rev[addr] = std::string(demangled);
+            unresolved_syms[demangled_str] = addr;
+            unresolved_syms_rev[addr] = demangled_str;
+            import_bind(addr, demangled_str);
             
             imports_size += import_size;
         }
         else if (symtab[i].st_shndx && demangled)
         {
-            resolved_syms[std::string(demangled)] = NRO + symtab[i].st_value;
-            resolved_syms_rev[NRO + symtab[i].st_value] = std::string(demangled);
+            resolved_syms[demangled_str] = NRO + symtab[i].st_value;
+            resolved_syms_rev[NRO + symtab[i].st_value] = demangled_str;
+            import_bind(NRO + symtab[i].st_value, demangled_str);
         }
         else
         {
 
         }
-        free(demangled);
+    }
+    
+    // Symbols resolve by name, a definition anywhere wins over an import
+    sym_addrs.assign(numsyms, 0);
+    for (uint64_t i = 0; i < numsyms; i++)
+    {
+        if (names[i].empty()) continue;
+
+        auto resolved = resolved_syms.find(names[i]);
+        auto unresolved = unresolved_syms.find(names[i]);
+        if (resolved != resolved_syms.end() && resolved->second)
+            sym_addrs[i] = resolved->second;
+        else if (unresolved != unresolved_syms.end())
+            sym_addrs[i] = unresolved->second;
     }
     
     syms_scanned = true;
@@ -140,9 +201,7 @@ void nro_relocate(void* base)
     const Elf64_Dyn* dyn = NULL;
     const Elf64_Rela* rela = NULL;
     const Elf64_Sym* symtab = NULL;
-    const char* strtab = NULL;
     uint64_t relasz = 0;
-    uint64_t numsyms = 0;
     
     struct nso_header* header = (struct nso_header*)base;
     struct mod0_header* modheader = (struct mod0_header*)(base + header->mod);
@@ -155,9 +214,6 @@ void nro_relocate(void* base)
             case DT_SYMTAB:
                 symtab = (const Elf64_Sym*)(base + dyn->d_un.d_ptr);
                 break;
-            case DT_STRTAB:
-                strtab = (const char*)(base + dyn->d_un.d_ptr);
-                break;
             case DT_RELA:
                 rela = (const Elf64_Rela*)(base + dyn->d_un.d_ptr);
                 break;
@@ -178,7 +234,6 @@ void nro_relocate(void* base)
     for (; relasz--; rela++)
     {
         uint32_t sym_idx = ELF64_R_SYM(rela->r_info);
-        const char* name = strtab + symtab[sym_idx].st_name;
 
         uint64_t sym_val = (uint64_t)base + symtab[sym_idx].st_value;
         if (!symtab[sym_idx].st_value)
@@ -197,16 +252,11 @@ void nro_relocate(void* base)
             case R_AARCH64_ABS64:
             {
                 uint64_t* ptr = (uint64_t*)(base + rela->r_offset);
-                char* demangled = abi::__cxa_demangle(name, 0, 0, 0);
                 
-                if (demangled)
+                if (sym_idx < sym_addrs.size() && sym_addrs[sym_idx])
                 {
-                    //printf("@ %" PRIx64 ", %s -> %" PRIx64 ", %" PRIx64 "\n", NRO + rela->r_offset, demangled, unresolved_syms[std::string(demangled)], *ptr);
-                    if (resolved_syms[std::string(demangled)])
-                        *ptr = resolved_syms[std::string(demangled)];
-                    else
-                        *ptr = unresolved_syms[std::string(demangled)];
-                    free(demangled);
+                    //printf("@ %" PRIx64 ", %u -> %" PRIx64 ", %" PRIx64 "\n", NRO + rela->r_offset, sym_idx, sym_addrs[sym_idx], *ptr);
+                    *ptr = sym_addrs[sym_idx];
                 }
                 break;
             }
@@ -224,29 +274,29 @@ uint64_t hash40(const void* data, size_t len)
     return crc32(data, len) | (len & 0xFF) << 32;
 }
 
-typedef struct cluster_struct
+// Every agent/function name a funcptr was registered under
+typedef struct cluster_target
 {
     std::string agent_name;
     std::string func_name;
+} cluster_target;
+
+typedef struct cluster_struct
+{
+    std::vector<cluster_target> targets;
     std::string outdir;
     uint64_t funcptr;
 } cluster_struct;
 
-void transpile_thread(LuaTranspiler* transpiler)
-{
-    delete transpiler;
-}
-
-void cluster_oncomplete(ClusterManager* cluster, uint64_t ret, void* data)
+// Blocks and Lua are rendered once per funcptr, every target sharing it
+// gets its own header in front of the same blocks and the same .lc
+void cluster_write(const cluster_target& target, std::string outdir, uint64_t func_hash, const std::string& blocks, const std::string& lua_path)
 {
     char tmp[256];
     std::string out = "";
-    cluster_struct* vals = (cluster_struct*)data;
     
-    std::string agent_name = vals->agent_name;
-    std::string func_name = vals->func_name;
-    std::string outdir = vals->outdir;
-    uint64_t funcptr = vals->funcptr;
+    std::string agent_name = target.agent_name;
+    std::string func_name = target.func_name;
 
     out += ">--------------------------------------<\n";
     
@@ -272,46 +322,65 @@ void cluster_oncomplete(ClusterManager* cluster, uint64_t ret, void* data)
     std::filesystem::create_directories(dir_out);
     std::ofstream file(file_out);
     
-    snprintf(tmp, 255, "                %8" PRIx64 "\n", cluster->block_hash(funcptr));
+    // Structural hash, identical bodies at different addresses share it
+    snprintf(tmp, 255, "                %16" PRIx64 "\n", func_hash);
     out += std::string(tmp);
     out += ">--------------------------------------<\n";
 
     file << out;
+    file << blocks;
+    file << "<-------------------------------------->\n";
+    
+    if (file_out_lua == lua_path) return;
+    
+    // Linked where possible so shared functions only take up the space once
+    std::error_code err;
+    std::filesystem::remove(file_out_lua, err);
+    std::filesystem::create_hard_link(lua_path, file_out_lua, err);
+    if (err)
+        std::filesystem::copy_file(lua_path, file_out_lua, std::filesystem::copy_options::overwrite_existing, err);
+    if (err)
+        printf_error("Failed to write %s: %s\n", file_out_lua.c_str(), err.message().c_str());
+}
 
+void cluster_oncomplete(ClusterManager* cluster, uint64_t ret, void* data)
+{
+    cluster_struct* vals = (cluster_struct*)data;
+    
+    std::ostringstream blocks;
     try {
-        cluster->print_blocks(funcptr, file);
+        cluster->print_blocks(vals->funcptr, blocks);
     } catch (std::exception& e) {
         std::cout << "Failed to write blocks with exception:" << std::endl;
         std::cout << e.what() << std::endl;
     }
-
-    file << "<-------------------------------------->\n";
     
-    clusters_active--;
+    // Already on a cluster worker, so transpile here rather than on yet another thread
+    const cluster_target& first = vals->targets[0];
+    std::string lua_path = vals->outdir + "/" + first.agent_name + "/" + first.func_name + ".lc";
+    std::filesystem::create_directories(vals->outdir + "/" + first.agent_name);
+    delete new LuaTranspiler(lua_path, cluster->tokens, vals->funcptr);
     
-    std::thread transpile(transpile_thread, new LuaTranspiler(file_out_lua, cluster->tokens, funcptr));
-    transpile.detach();
+    uint64_t func_hash = cluster->function_hash(vals->funcptr);
+    std::string blocks_out = blocks.str();
+    for (auto& target : vals->targets)
+    {
+        cluster_write(target, vals->outdir, func_hash, blocks_out, lua_path);
+    }
     
     delete vals;
+    worker_engine.reset(cluster->release_engine());
     delete cluster;
 }
 
-void cluster_work(ClusterManager* cluster, std::string character, std::string outdir, uint64_t l2cagent, uint64_t funcptr, uint64_t hash)
+std::string cluster_func_name(uint64_t hash)
 {
-    std::string out = "";
-
-    out += ">--------------------------------------<\n";
-    
-    std::string agent_name = l2cagents_rev[l2cagent];
-    
-    std::string func_name = "";
-    if (unhash[hash].length() != 0)
-    {
-        func_name = unhash[hash];
-    }
-    else if (status_funcs[hash].length() != 0)
+    std::string func_name = unhash_find(hash);
+    if (func_name.length() == 0)
     {
-        func_name = status_funcs[hash];
+        auto status_func = status_funcs.find(hash);
+        if (status_func != status_funcs.end())
+            func_name = status_func->second;
     }
     
     if (func_name.length() == 0)
@@ -320,57 +389,75 @@ void cluster_work(ClusterManager* cluster, std::string character, std::string ou
         snprintf(tmp, 255, "%" PRIx64, hash);
         func_name = std::string(tmp);
     }
+    
+    return func_name;
+}
 
-    while (clusters_active >= MAX_CLUSTERS_ACTIVE || uc_insts_active > (MAX_CLUSTERS_ACTIVE - 10))
-    {
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(10ms);
-    }
+bool agent_is_ai_mode(const std::string& character, const std::string& agent_name)
+{
+    return !strncmp(agent_name.c_str() + character.size() + 1, "ai_mode", 7);
+}
 
-    printf("%s/%s %zx %" PRIx64 " %" PRIx64 "\n", agent_name.c_str(), func_name.c_str(), func_name.length(), funcptr, hash);
-    
+// Emulates funcptr once on behalf of every (agent, hash) registered to it.
+// They all get passed the first agent.
+void cluster_work(ClusterPool* pool, ClusterManager* cluster, std::string character, std::string outdir, uint64_t funcptr, const std::vector<std::pair<uint64_t, uint64_t> >& uses)
+{
     cluster_struct* vals = new cluster_struct;
-    vals->agent_name = agent_name;
-    vals->func_name = func_name;
     vals->outdir = outdir;
     vals->funcptr = funcptr;
     
+    for (auto& use : uses)
+    {
+        cluster_target target;
+        target.agent_name = l2cagents_rev[use.first];
+        target.func_name = cluster_func_name(use.second);
+        vals->targets.push_back(target);
+
+        printf("%s/%s %zx %" PRIx64 " %" PRIx64 "\n", target.agent_name.c_str(), target.func_name.c_str(), target.func_name.length(), funcptr, use.second);
+    }
+    
+    uint64_t l2cagent = uses[0].first;
+    bool ai_mode = agent_is_ai_mode(character, vals->targets[0].agent_name);
+    
     /*std::thread* t = cluster->execute_threaded(funcptr, cluster_oncomplete, vals, true, true, l2cagent, 0xFFFA000000000000);
     t->join();
     delete t;*/
     
-    uint64_t x1, x2;
-    
-    
-    ClusterManager* clone = new ClusterManager(cluster);
-    clusters_active++;
-
-    // if (func_name.find("STATUS_MAIN") != std::string::npos) {
-    //     uc_mem_write(
-    //         clone->get_uc(), 
-    //         funcptr + 4,
-    //         "\x1f\x20\x03\xd5",
-    //         4);
-    // }
-    
-    if (!strncmp(agent_name.c_str() + character.size() + 1, "ai_mode", 7))
-    {
-        //TODO: some sorta registration for these input vars
-        x1 = clone->heap_alloc(0x10);
-        x2 = clone->heap_alloc(0x10);
-    }
-    else
-    {
-        x1 = 0xFFFA000000000000;
-        x2 = 0xFFFA000000000000;
-    }
-    
-    std::thread* t = clone->execute_threaded(funcptr, cluster_oncomplete, vals, true, true, l2cagent, x1, x2);
-    t->detach();
-    delete t;
+    // Cloning waits on the memory budget, so leave it to the worker
+    pool->submit([=]() {
+        uint64_t x1, x2;
+        
+        ClusterManager* clone = new ClusterManager(cluster, worker_engine.release());
+
+        // if (func_name.find("STATUS_MAIN") != std::string::npos) {
+        //     uc_mem_write(
+        //         clone->get_uc(), 
+        //         funcptr + 4,
+        //         "\x1f\x20\x03\xd5",
+        //         4);
+        // }
+        
+        if (ai_mode)
+        {
+            //TODO: some sorta registration for these input vars
+            x1 = clone->heap_alloc(0x10);
+            x2 = clone->heap_alloc(0x10);
+        }
+        else
+        {
+            x1 = 0xFFFA000000000000;
+            x2 = 0xFFFA000000000000;
+        }
+        
+        uint64_t ret = clone->execute(funcptr, true, true, l2cagent, x1, x2);
+        cluster_oncomplete(clone, ret, vals);
+    });
 }
 
-int main(int argc, char **argv, char **envp)
+// Everything the dispatch loop needs set up in the base cluster: the const
+// value table, agents for each of the character's objects and the lua_State
+// vtable stubs. Only depends on the NRO, so warm runs load it from a snapshot.
+void cluster_setup(ClusterManager* cluster, const std::string& character)
 {
     char tmp[256];
     uint64_t x0, x1, x2, x3;
@@ -378,57 +465,15 @@ int main(int argc, char **argv, char **envp)
     x2 = 0xFFFD000000000000; // BattleObjectModuleAccessor
     x3 = 0xFFFC000000000000; // lua_state
     
-    if (argc < 3)
-    {
-        printf("Usage: %s <lua2cpp_char.nro> <outdir>\n", argv[0]);
-        return -1;
-    }
-
-    init_character_objects();
-    init_const_value_table();
-    
-    // Load in unhashed strings
-    std::ifstream strings("hashstrings_lower.txt");    
-    std::string line;
-    while (std::getline(strings, line))
-    {
-        uint64_t crc = hash40((const void*)line.c_str(), strlen(line.c_str()));
-        unhash[crc] = line;
-    }
-    
-    ClusterManager cluster = ClusterManager(std::string(argv[1]));
-    
-    // Scan exports to find the character name
-    std::string character = "";
-    for (auto& pair : resolved_syms)
-    {
-        std::string func = pair.first;
-        char* match = "lua2cpp::create_agent_fighter_status_script_";
-        
-        
-        if (!strncmp(func.c_str(), match, strlen(match)))
-        {
-            for (int i = strlen(match); i < func.length(); i++)
-            {
-                if (func[i] == '(') break;
-                character += func[i];
-            }
-            break;
-        }
-    }
-    
-    logmask_unset(LOGMASK_DEBUG | LOGMASK_INFO);
-    // logmask_set(LOGMASK_VERBOSE);
-
     uint32_t babe_indices[CONST_VALUE_TABLE_SIZE];
     for (size_t i = 0; i < CONST_VALUE_TABLE_SIZE; i++) {
         babe_indices[i] = i | 0xBABE0000;
     }
 
     if (unresolved_syms["lua2cpp::L2CAgentGeneratedBase::const_value_table__"])
-        memcpy(cluster.uc_ptr_to_real_ptr(unresolved_syms["lua2cpp::L2CAgentGeneratedBase::const_value_table__"]), babe_indices, sizeof(babe_indices));
+        memcpy(cluster->uc_ptr_to_real_ptr(unresolved_syms["lua2cpp::L2CAgentGeneratedBase::const_value_table__"]), babe_indices, sizeof(babe_indices));
     else
-        memcpy(cluster.uc_ptr_to_real_ptr(resolved_syms["lua2cpp::L2CAgentGeneratedBase::const_value_table__"]), babe_indices, sizeof(babe_indices));
+        memcpy(cluster->uc_ptr_to_real_ptr(resolved_syms["lua2cpp::L2CAgentGeneratedBase::const_value_table__"]), babe_indices, sizeof(babe_indices));
 
     for (auto& agent : agents)
     {
@@ -443,13 +488,13 @@ int main(int argc, char **argv, char **envp)
             uint64_t output;
             void* l2c_fighter;
             if (agent == "status_script" && character == "common") {
-                cluster.add_import_hook(resolved_syms["lua2cpp::L2CAgentBase::sv_set_status_func(lib::L2CValue const&, lib::L2CValue const&, void*)"]);
-                cluster.add_import_hook(resolved_syms["lua2cpp::L2CAgentBase::sv_copy_status_func(lib::L2CValue const&, lib::L2CValue const&, lib::L2CValue const&)"]);
+                cluster->add_import_hook(resolved_syms["lua2cpp::L2CAgentBase::sv_set_status_func(lib::L2CValue const&, lib::L2CValue const&, void*)"]);
+                cluster->add_import_hook(resolved_syms["lua2cpp::L2CAgentBase::sv_copy_status_func(lib::L2CValue const&, lib::L2CValue const&, lib::L2CValue const&)"]);
     
                 func = "lua2cpp::L2CFighterCommon::sub_set_fighter_common_table";
                 args = "()";
 
-                x0 = cluster.heap_alloc(0x1000);
+                x0 = cluster->heap_alloc(0x1000);
                 // NOP random member funcs
                 uint64_t to_nop[8] = {
                     0x1002d186c, 0x1002d1870, 0x1002d1874, 0x1002d1878,
@@ -458,7 +503,7 @@ int main(int argc, char **argv, char **envp)
                 uint32_t ret_asm = INSTR_RET;
                 for (auto nop_addr : to_nop) {
                     uc_mem_write(
-                        cluster.get_uc(), 
+                        cluster->get_uc(), 
                         nop_addr,
                         "\x1f\x20\x03\xd5",
                         4);
@@ -466,12 +511,12 @@ int main(int argc, char **argv, char **envp)
                 
                 // stub status func setter
                 uc_mem_write(
-                    cluster.get_uc(), 
+                    cluster->get_uc(), 
                     resolved_syms["lua2cpp::L2CAgentBase::sv_set_status_func(lib::L2CValue const&, lib::L2CValue const&, void*)"],
                     &ret_asm,
                     4);
                 uc_mem_write(
-                    cluster.get_uc(), 
+                    cluster->get_uc(), 
                     resolved_syms["lua2cpp::L2CAgentBase::sv_copy_status_func(lib::L2CValue const&, lib::L2CValue const&, lib::L2CValue const&)"],
                     &ret_asm,
                     4);
@@ -483,7 +528,7 @@ int main(int argc, char **argv, char **envp)
             if (!funcptr) continue;
             
             printf_debug("Running %s(hash40(%s) => 0x%08x, ...)...\n", func.c_str(), hashstr.c_str(), x0);
-            output = cluster.execute(funcptr, false, false, x0, x1, x2, x3);
+            output = cluster->execute(funcptr, false, false, x0, x1, x2, x3);
             
             if (output)
             {
@@ -498,13 +543,13 @@ int main(int argc, char **argv, char **envp)
                 // so we run function 9 to actually set everything
                 if (agent == "status_script" && character != "common")
                 {
-                    uint64_t vtable_ptr = *(uint64_t*)(cluster.uc_ptr_to_real_ptr(output));
-                    uint64_t* vtable = ((uint64_t*)(cluster.uc_ptr_to_real_ptr(vtable_ptr)));
+                    uint64_t vtable_ptr = *(uint64_t*)(cluster->uc_ptr_to_real_ptr(output));
+                    uint64_t* vtable = ((uint64_t*)(cluster->uc_ptr_to_real_ptr(vtable_ptr)));
                     uint64_t func = vtable[9];
 
-                    cluster.clear_state();
+                    cluster->clear_state();
 
-                    cluster.execute(func, true, true, output);
+                    cluster->execute(func, true, true, output);
                 }
             }
         }
@@ -513,21 +558,21 @@ int main(int argc, char **argv, char **envp)
     //logmask_set(LOGMASK_VERBOSE);
 
     // Set up L2CAgent
-    uint64_t luastate = cluster.heap_alloc(0x1000);
+    uint64_t luastate = cluster->heap_alloc(0x1000);
     
     for (int i = 0; i < 0x200; i += 8)
     {
-        uint64_t class_alloc = cluster.heap_alloc(0x100);
-        uint64_t vtable_alloc = cluster.heap_alloc(512 * sizeof(uint64_t));
+        uint64_t class_alloc = cluster->heap_alloc(0x100);
+        uint64_t vtable_alloc = cluster->heap_alloc(512 * sizeof(uint64_t));
 
-        *(uint64_t*)(cluster.uc_ptr_to_real_ptr(luastate + i)) = class_alloc;
-        *(uint64_t*)(cluster.uc_ptr_to_real_ptr(class_alloc)) = vtable_alloc;
+        *(uint64_t*)(cluster->uc_ptr_to_real_ptr(luastate + i)) = class_alloc;
+        *(uint64_t*)(cluster->uc_ptr_to_real_ptr(class_alloc)) = vtable_alloc;
         
         //printf("%llx %llx %llx\n", l2cagent, class_alloc, vtable_alloc);
 
         for (int j = 0; j < 512; j++)
         {
-            uint64_t* out = (uint64_t*)cluster.uc_ptr_to_real_ptr(vtable_alloc + j * sizeof(uint64_t));
+            uint64_t* out = (uint64_t*)cluster->uc_ptr_to_real_ptr(vtable_alloc + j * sizeof(uint64_t));
             uint64_t addr = IMPORTS + (imports_size + 0x8);
             imports_size += 0x8;
 
@@ -542,16 +587,17 @@ int main(int argc, char **argv, char **envp)
             
             unresolved_syms[name] = addr;
             unresolved_syms_rev[addr] = name;
+            import_bind(addr, name);
             *out = addr;
             
-            cluster.add_import_hook(addr);
+            cluster->add_import_hook(addr);
         }
     }
 
     for (auto& pair : l2cagents)
     {
         uint64_t l2cagent = pair.second;
-        L2CAgent* agent = (L2CAgent*)cluster.uc_ptr_to_real_ptr(l2cagent);
+        L2CAgent* agent = (L2CAgent*)cluster->uc_ptr_to_real_ptr(l2cagent);
         agent->lua_state_agent = luastate;
         agent->lua_state_agentbase = luastate;
         // Set battle object, boma, lua_state if it hasn't been done already
@@ -559,8 +605,110 @@ int main(int argc, char **argv, char **envp)
         *(uint64_t*)(((uint64_t)agent) + 0x40) = x2;
         *(uint64_t*)(((uint64_t)agent)+ 0x48) = x3;
     }
+}
+
+int main(int argc, char **argv, char **envp)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <lua2cpp_char.nro> <outdir> [--single-step] [--fork-threads n] [--fork-order dfs|bfs] [--no-hash-trace] [--cluster-threads n] [--no-snapshot]\n", argv[0]);
+        return -1;
+    }
+    
+    for (int i = 3; i < argc; i++)
+    {
+        // Slow mode steps one instruction per slice, mostly useful for
+        // comparing output against the block-granular slices
+        if (!strcmp(argv[i], "--single-step"))
+            slow_block_slices = false;
+        // Diverged forks of a function can run on several threads, each with its
+        // own engine. Output can differ run to run since convergence is racy.
+        else if (!strcmp(argv[i], "--fork-threads") && i + 1 < argc)
+            fork_threads = atoi(argv[++i]);
+        // Depth-first keeps only one fork chain alive at a time, breadth-first
+        // finishes shallow forks first at the cost of more of them in memory
+        else if (!strcmp(argv[i], "--fork-order") && i + 1 < argc)
+            fork_breadth_first = !strcmp(argv[++i], "bfs");
+        // Recovering hash strings from CRC32 lookups is only worth the
+        // slower memory accesses while the dictionary is missing entries
+        else if (!strcmp(argv[i], "--no-hash-trace"))
+            hash_tracing = false;
+        // Functions are emulated on a fixed pool of threads, one per core by default
+        else if (!strcmp(argv[i], "--cluster-threads") && i + 1 < argc)
+            cluster_threads = atoi(argv[++i]);
+        // Always set up from scratch and leave any saved snapshot alone
+        else if (!strcmp(argv[i], "--no-snapshot"))
+            use_snapshot = false;
+    }
+
+    init_character_objects();
+    
+    // Setup leaves the same state behind every run for the same NRO, so it's
+    // saved next to it and loaded instead while nothing it depends on changes
+    std::string snapshot_path = std::string(argv[1]) + ".snapshot";
+    uint64_t snapshot = use_snapshot ? snapshot_key(argv[1]) : 0;
+    std::unique_ptr<ClusterManager> cluster(snapshot ? snapshot_load(snapshot_path, snapshot) : nullptr);
+    bool warm = cluster != nullptr;
+    
+    if (!warm)
+    {
+        init_const_value_table();
+        
+        // Load in unhashed strings
+        std::ifstream strings("hashstrings_lower.txt");    
+        std::string line;
+        while (std::getline(strings, line))
+        {
+            uint64_t crc = hash40((const void*)line.c_str(), strlen(line.c_str()));
+            unhash[crc] = line;
+        }
+        
+        cluster.reset(new ClusterManager(std::string(argv[1])));
+    }
+    
+    // Scan exports to find the character name
+    std::string character = "";
+    for (auto& pair : resolved_syms)
+    {
+        std::string func = pair.first;
+        char* match = "lua2cpp::create_agent_fighter_status_script_";
+        
+        
+        if (!strncmp(func.c_str(), match, strlen(match)))
+        {
+            for (int i = strlen(match); i < func.length(); i++)
+            {
+                if (func[i] == '(') break;
+                character += func[i];
+            }
+            break;
+        }
+    }
+    
+    logmask_unset(LOGMASK_DEBUG | LOGMASK_INFO);
+    // logmask_set(LOGMASK_VERBOSE);
+
+    if (!warm)
+    {
+        cluster_setup(cluster.get(), character);
+        if (snapshot)
+            snapshot_save(snapshot_path, snapshot, cluster.get());
+    }
+
+    cluster->set_heap_fixed(true);
+    cluster->share_image();
     
-    cluster.set_heap_fixed(true);
+    int num_workers = cluster_threads > 0 ? cluster_threads : std::thread::hardware_concurrency();
+    if (num_workers < 1)
+        num_workers = 1;
+    // A job holds a root instance, plus its own image copy unless it's shared
+    uint64_t job_mem = STACK_SIZE + HEAP_SIZE + (image_is_shared() ? 0 : NRO_SIZE + IMPORTS_SIZE);
+    ClusterPool pool(num_workers, num_workers * CLUSTER_QUEUE_PER_WORKER, job_mem);
+    
+    // Agents like the *_share ones register the same funcptr under several
+    // names, those only need emulating once. AI mode agents get different
+    // inputs, so they're kept apart.
+    std::map<std::pair<uint64_t, bool>, std::vector<std::pair<uint64_t, uint64_t> > > funcptr_uses;
     for (auto& pair : function_hashes)
     {
         auto regpair = pair.first;
@@ -572,18 +720,21 @@ int main(int argc, char **argv, char **envp)
         //if (funcptr == 0x1000cc6d0)
         //if (l2cagents_rev[l2cagent] == "wolf_ai_mode")
         {
-            cluster_work(&cluster, character, std::string(argv[2]), l2cagent, funcptr, hash);
+            bool ai_mode = agent_is_ai_mode(character, l2cagents_rev[l2cagent]);
+            funcptr_uses[std::make_pair(funcptr, ai_mode)].push_back(std::make_pair(l2cagent, hash));
         }
     }
     
-    while (clusters_active.load())
+    printf_info("%zu functions registered, %zu unique to emulate\n", function_hashes.size(), funcptr_uses.size());
+    for (auto& pair : funcptr_uses)
     {
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(10ms);
+        cluster_work(&pool, cluster.get(), character, std::string(argv[2]), pair.first.first, pair.second);
     }
     
+    pool.join();
+    
         
-    cluster.clear_state();
+    cluster->clear_state();
 
     return 0;
 }
@@ -10,6 +10,10 @@
 #include "l2c.h"
 
 extern bool trace_code;
+extern bool slow_block_slices;
+extern int fork_threads;
+extern bool fork_breadth_first;
+extern bool hash_tracing;
 
 extern std::map<uint64_t, std::string> unhash;
 extern std::map<std::string, uint64_t> unresolved_syms;
@@ -17,6 +21,10 @@ extern std::map<uint64_t, std::string> unresolved_syms_rev;
 extern std::map<std::string, uint64_t> resolved_syms;
 extern std::map<uint64_t, std::string> resolved_syms_rev;
 extern std::map<std::pair<uint64_t, uint64_t>, uint64_t> function_hashes;
+extern std::map<std::string, uint64_t> l2cagents;
+extern std::map<uint64_t, std::string> l2cagents_rev;
+extern int imports_size;
+extern bool syms_scanned;
 
 extern void nro_assignsyms(void* base);
 extern void nro_relocate(void* base);
@@ -0,0 +1,109 @@
+#include "slabpool.h"
+
+#include "uc_inst.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+
+// Cached slabs count against the instance memory budget like live ones
+static std::atomic<uint64_t> slab_cached_bytes = 0;
+
+// Fork workers only live as long as one ForkPool run, so slabs cached on
+// a worker are handed over here when it exits for the next one to pick up
+static std::mutex slab_shared_lock;
+static std::map<size_t, std::vector<void*> > slab_shared;
+
+struct SlabCache
+{
+    std::map<size_t, std::vector<void*> > free_slabs;
+    
+    ~SlabCache()
+    {
+        std::lock_guard<std::mutex> lock(slab_shared_lock);
+        for (auto& pair : free_slabs)
+        {
+            auto& shared = slab_shared[pair.first];
+            shared.insert(shared.end(), pair.second.begin(), pair.second.end());
+        }
+        
+        // Anyone waiting on the budget can trim these now
+        uc_res_notify();
+    }
+};
+
+static thread_local SlabCache slab_cache;
+
+void* slab_take(size_t size)
+{
+    auto& slabs = slab_cache.free_slabs[size];
+    if (!slabs.empty())
+    {
+        void* slab = slabs.back();
+        slabs.pop_back();
+        slab_cached_bytes -= size;
+        return slab;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(slab_shared_lock);
+        auto& shared = slab_shared[size];
+        if (!shared.empty())
+        {
+            void* slab = shared.back();
+            shared.pop_back();
+            slab_cached_bytes -= size;
+            return slab;
+        }
+    }
+    
+    void* slab = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (slab == MAP_FAILED)
+    {
+        printf_error("Failed to map a %zx byte guest memory slab\n", size);
+        return nullptr;
+    }
+    return slab;
+}
+
+void slab_give(void* slab, size_t size)
+{
+    if (!slab) return;
+
+    if (uc_memory_use + slab_cached_bytes + size > MAX_UC_MEM)
+    {
+        munmap(slab, size);
+        return;
+    }
+    
+    slab_cache.free_slabs[size].push_back(slab);
+    slab_cached_bytes += size;
+}
+
+uint64_t slab_cached()
+{
+    return slab_cached_bytes;
+}
+
+static void slab_trim_list(std::map<size_t, std::vector<void*> >& free_slabs)
+{
+    for (auto& pair : free_slabs)
+    {
+        while (!pair.second.empty() && uc_memory_use + slab_cached_bytes > MAX_UC_MEM)
+        {
+            munmap(pair.second.back(), pair.first);
+            pair.second.pop_back();
+            slab_cached_bytes -= pair.first;
+        }
+    }
+}
+
+void slab_trim()
+{
+    slab_trim_list(slab_cache.free_slabs);
+
+    std::lock_guard<std::mutex> lock(slab_shared_lock);
+    slab_trim_list(slab_shared);
+}
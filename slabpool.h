@@ -0,0 +1,20 @@
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Page-aligned, pre-faulted guest memory for instance stacks and heaps.
+// Returned slabs are cached on the returning thread and handed back out
+// from there, so steady-state forking never goes to the kernel. A thread's
+// cache outlives it in a shared list that other threads fall back on.
+// Contents of a reused slab are whatever its last owner left in it.
+void* slab_take(size_t size);
+void slab_give(void* slab, size_t size);
+
+// Bytes sitting in caches, and unmapping them, this thread's own first,
+// until live plus cached memory is back within the budget
+uint64_t slab_cached();
+void slab_trim();
+
+#endif // SLABPOOL_H
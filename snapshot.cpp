@@ -0,0 +1,482 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <type_traits>
+#include <vector>
+
+#include "main.h"
+#include "constants.h"
+#include "clustermanager.h"
+#include "logging.h"
+
+#define SNAPSHOT_MAGIC 0x504E534E // "NSNP"
+
+// Bump whenever what gets saved changes
+#define SNAPSHOT_VERSION 1
+
+static_assert(std::is_trivially_copyable<uc_reg_state>::value, "uc_reg_state is saved as raw bytes");
+
+// FNV-1a over 8-byte words with an extra shift to carry high bits back down,
+// only has to tell inputs apart
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, std::min<size_t>(8, size - i));
+        h = (h ^ word) * 0x100000001B3ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Missing files hash like empty ones, setup treats them the same way
+static uint64_t hash_file(uint64_t h, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return hash_bytes(h, "", 1);
+
+    std::vector<char> buf(0x100000);
+    size_t read;
+    uint64_t total = 0;
+    while ((read = fread(buf.data(), 1, buf.size(), f)) > 0)
+    {
+        h = hash_bytes(h, buf.data(), read);
+        total += read;
+    }
+    fclose(f);
+
+    return hash_bytes(h, &total, sizeof(total));
+}
+
+uint64_t snapshot_key(const std::string& nro_path)
+{
+    struct stat nro;
+    if (stat(nro_path.c_str(), &nro)) return 0;
+
+    uint64_t h = 0xCBF29CE484222325ull;
+    uint64_t opts[] = {SNAPSHOT_VERSION, hash_tracing, slow_block_slices, (uint64_t)fork_threads, fork_breadth_first};
+    h = hash_bytes(h, opts, sizeof(opts));
+
+    // Setup runs through the import handlers, a rebuilt binary may set up differently
+    struct stat exe;
+    if (!stat("/proc/self/exe", &exe))
+    {
+        uint64_t ids[] = {(uint64_t)exe.st_size, (uint64_t)exe.st_mtime};
+        h = hash_bytes(h, ids, sizeof(ids));
+    }
+
+    h = hash_file(h, nro_path.c_str());
+    h = hash_file(h, "hashstrings_lower.txt");
+    h = hash_file(h, "const_value_table_with_values_810.csv");
+
+    return h ? h : 1;
+}
+
+class SnapshotWriter
+{
+public:
+    std::string out;
+
+    void put_bytes(const void* data, size_t size)
+    {
+        out.append((const char*)data, size);
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value>::type put(T val)
+    {
+        put_bytes(&val, sizeof(val));
+    }
+
+    void put(const std::string& str)
+    {
+        put<uint64_t>(str.length());
+        put_bytes(str.data(), str.length());
+    }
+
+    // Sized so a truncated or mismatched blob is caught on load
+    void put_blob(const void* data, size_t size)
+    {
+        put<uint64_t>(size);
+        put_bytes(data, size);
+    }
+
+    template <typename A, typename B>
+    void put(const std::pair<A, B>& pair)
+    {
+        put(pair.first);
+        put(pair.second);
+    }
+
+    template <typename T>
+    void put(const std::set<T>& set)
+    {
+        put<uint64_t>(set.size());
+        for (auto& val : set)
+            put(val);
+    }
+
+    template <typename T>
+    void put(const std::vector<T>& vec)
+    {
+        put<uint64_t>(vec.size());
+        for (auto& val : vec)
+            put(val);
+    }
+
+    template <typename K, typename V>
+    void put(const std::map<K, V>& map)
+    {
+        put<uint64_t>(map.size());
+        for (auto& pair : map)
+        {
+            put(pair.first);
+            put(pair.second);
+        }
+    }
+};
+
+// Reads back what SnapshotWriter wrote. Running off the end clears ok and
+// every read after that returns nothing.
+class SnapshotReader
+{
+private:
+    const char* cur;
+    const char* end;
+
+public:
+    bool ok = true;
+
+    SnapshotReader(const void* data, size_t size) : cur((const char*)data), end((const char*)data + size) {}
+
+    const void* take(uint64_t size)
+    {
+        if (!ok || size > (uint64_t)(end - cur))
+        {
+            ok = false;
+            return nullptr;
+        }
+
+        const void* out = cur;
+        cur += size;
+        return out;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value>::type get(T& val)
+    {
+        const void* data = take(sizeof(val));
+        if (data)
+            memcpy(&val, data, sizeof(val));
+        else
+            val = T();
+    }
+
+    void get(std::string& str)
+    {
+        uint64_t len = 0;
+        get(len);
+        const char* data = (const char*)take(len);
+        str = data ? std::string(data, len) : std::string();
+    }
+
+    const void* get_blob(uint64_t size)
+    {
+        uint64_t stored = 0;
+        get(stored);
+        if (stored != size)
+            ok = false;
+        return take(size);
+    }
+
+    template <typename A, typename B>
+    void get(std::pair<A, B>& pair)
+    {
+        get(pair.first);
+        get(pair.second);
+    }
+
+    template <typename T>
+    void get(std::set<T>& set)
+    {
+        uint64_t count = 0;
+        get(count);
+        for (uint64_t i = 0; i < count && ok; i++)
+        {
+            T val;
+            get(val);
+            set.emplace_hint(set.end(), std::move(val));
+        }
+    }
+
+    template <typename T>
+    void get(std::vector<T>& vec)
+    {
+        uint64_t count = 0;
+        get(count);
+        for (uint64_t i = 0; i < count && ok; i++)
+        {
+            T val;
+            get(val);
+            vec.push_back(std::move(val));
+        }
+    }
+
+    template <typename K, typename V>
+    void get(std::map<K, V>& map)
+    {
+        uint64_t count = 0;
+        get(count);
+        for (uint64_t i = 0; i < count && ok; i++)
+        {
+            K key;
+            V val;
+            get(key);
+            get(val);
+            map.emplace_hint(map.end(), std::move(key), std::move(val));
+        }
+    }
+};
+
+bool snapshot_save(const std::string& path, uint64_t key, ClusterManager* cluster)
+{
+    auto time_start = std::chrono::steady_clock::now();
+    EmuInstance* inst = cluster->get_inst();
+    SnapshotWriter writer;
+
+    writer.put<uint32_t>(SNAPSHOT_MAGIC);
+    writer.put<uint32_t>(SNAPSHOT_VERSION);
+    writer.put(key);
+
+    // Token names sort by intern id, interning them in the same order again
+    // keeps warm runs emitting tokens in the same order as cold ones
+    std::vector<std::string> interned;
+    for (uint32_t i = L2C_TokenSym_Max; i < l2c_intern_count(); i++)
+        interned.push_back(l2c_sym_name(i));
+    writer.put(interned);
+
+    writer.put(imports_size);
+    writer.put(unresolved_syms);
+    writer.put(unresolved_syms_rev);
+    writer.put(resolved_syms);
+    writer.put(resolved_syms_rev);
+    writer.put(l2cagents);
+    writer.put(l2cagents_rev);
+    writer.put(function_hashes);
+    writer.put(status_funcs);
+    writer.put(unhash);
+    writer.put(unhash_parts);
+    writer.put(hash_cheat);
+    writer.put(hash_cheat_rev);
+    writer.put(hash_cheat_ptr);
+    writer.put(const_value_table);
+    writer.put(const_value_table_values);
+
+    // Base instance, only the part of the heap that was handed out
+    uint64_t heap_used = std::min<uint64_t>(inst->get_heap_size(), HEAP_SIZE);
+    writer.put(inst->get_heap_size());
+    writer.put_blob(inst->uc_ptr_to_real_ptr(HEAP), heap_used);
+    writer.put_blob(inst->uc_ptr_to_real_ptr(STACK), STACK_SIZE);
+    writer.put_blob(&inst->regs_cur, sizeof(inst->regs_cur));
+    writer.put(inst->sp_part1);
+    writer.put(inst->sp_part2);
+    writer.put(inst->last_crcs);
+
+    // Values on the stack were copied out of guest memory, raw holds guest addresses
+    writer.put<uint64_t>(inst->lua_stack.size());
+    for (auto& val : inst->lua_stack)
+    {
+        writer.put(val.type);
+        writer.put(val.unk);
+        writer.put(val.raw);
+    }
+
+    writer.put_blob(cluster->get_nro_mem(), NRO_SIZE);
+    writer.put_blob(cluster->get_import_mem(), IMPORTS_SIZE);
+
+    // Written aside and renamed over so an interrupted save never leaves
+    // a partial snapshot behind
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (!f)
+    {
+        printf_warn("Failed to open %s, startup snapshot not saved\n", tmp_path.c_str());
+        return false;
+    }
+
+    bool written = fwrite(writer.out.data(), 1, writer.out.size(), f) == writer.out.size();
+    written = !fclose(f) && written;
+    if (!written || rename(tmp_path.c_str(), path.c_str()))
+    {
+        printf_warn("Failed to write %s, startup snapshot not saved\n", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - time_start;
+    printf_debug("Saved startup snapshot %016" PRIx64 " to %s (%zu bytes) in %.3fms\n", key, path.c_str(), writer.out.size(), elapsed.count());
+    return true;
+}
+
+ClusterManager* snapshot_load(const std::string& path, uint64_t key)
+{
+    auto time_start = std::chrono::steady_clock::now();
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf_warn("Failed to map startup snapshot %s\n", path.c_str());
+        return nullptr;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    SnapshotReader reader(data, st.st_size);
+
+    uint32_t magic = 0, version = 0;
+    uint64_t stored_key = 0;
+    reader.get(magic);
+    reader.get(version);
+    reader.get(stored_key);
+    if (!reader.ok || magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION || stored_key != key)
+    {
+        printf_info("Startup snapshot %s is out of date, setting up from scratch\n", path.c_str());
+        munmap(data, st.st_size);
+        return nullptr;
+    }
+
+    // Everything is read aside first, a damaged snapshot leaves no trace
+    std::vector<std::string> interned;
+    int snap_imports_size = 0;
+    std::map<std::string, uint64_t> snap_unresolved_syms, snap_resolved_syms, snap_l2cagents;
+    std::map<uint64_t, std::string> snap_unresolved_syms_rev, snap_resolved_syms_rev, snap_l2cagents_rev;
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> snap_function_hashes;
+    std::map<uint64_t, std::string> snap_status_funcs, snap_unhash;
+    std::map<uint32_t, std::string> snap_unhash_parts;
+    std::map<uint64_t, uint64_t> snap_hash_cheat, snap_hash_cheat_rev;
+    uint64_t snap_hash_cheat_ptr = 0;
+    std::vector<std::string> snap_const_value_table;
+    std::vector<int> snap_const_value_table_values;
+
+    reader.get(interned);
+    reader.get(snap_imports_size);
+    reader.get(snap_unresolved_syms);
+    reader.get(snap_unresolved_syms_rev);
+    reader.get(snap_resolved_syms);
+    reader.get(snap_resolved_syms_rev);
+    reader.get(snap_l2cagents);
+    reader.get(snap_l2cagents_rev);
+    reader.get(snap_function_hashes);
+    reader.get(snap_status_funcs);
+    reader.get(snap_unhash);
+    reader.get(snap_unhash_parts);
+    reader.get(snap_hash_cheat);
+    reader.get(snap_hash_cheat_rev);
+    reader.get(snap_hash_cheat_ptr);
+    reader.get(snap_const_value_table);
+    reader.get(snap_const_value_table_values);
+
+    uint64_t heap_size = 0;
+    reader.get(heap_size);
+    uint64_t heap_used = std::min<uint64_t>(heap_size, HEAP_SIZE);
+    const void* heap = reader.get_blob(heap_used);
+    const void* stack = reader.get_blob(STACK_SIZE);
+    const void* regs = reader.get_blob(sizeof(uc_reg_state));
+
+    uint32_t sp_part1 = 0, sp_part2 = 0;
+    std::set<uint32_t> last_crcs;
+    reader.get(sp_part1);
+    reader.get(sp_part2);
+    reader.get(last_crcs);
+
+    uint64_t lua_stack_size = 0;
+    std::vector<L2CValue> lua_stack;
+    reader.get(lua_stack_size);
+    for (uint64_t i = 0; i < lua_stack_size && reader.ok; i++)
+    {
+        L2CValue val;
+        reader.get(val.type);
+        reader.get(val.unk);
+        reader.get(val.raw);
+        lua_stack.push_back(val);
+    }
+
+    const void* nro_image = reader.get_blob(NRO_SIZE);
+    const void* import_image = reader.get_blob(IMPORTS_SIZE);
+
+    if (!reader.ok)
+    {
+        printf_warn("Startup snapshot %s is damaged, setting up from scratch\n", path.c_str());
+        munmap(data, st.st_size);
+        return nullptr;
+    }
+
+    for (auto& name : interned)
+        l2c_intern(name);
+
+    imports_size = snap_imports_size;
+    unresolved_syms.swap(snap_unresolved_syms);
+    unresolved_syms_rev.swap(snap_unresolved_syms_rev);
+    resolved_syms.swap(snap_resolved_syms);
+    resolved_syms_rev.swap(snap_resolved_syms_rev);
+    l2cagents.swap(snap_l2cagents);
+    l2cagents_rev.swap(snap_l2cagents_rev);
+    function_hashes.swap(snap_function_hashes);
+    status_funcs.swap(snap_status_funcs);
+    unhash.swap(snap_unhash);
+    unhash_parts.swap(snap_unhash_parts);
+    hash_cheat.swap(snap_hash_cheat);
+    hash_cheat_rev.swap(snap_hash_cheat_rev);
+    hash_cheat_ptr = snap_hash_cheat_ptr;
+    const_value_table.swap(snap_const_value_table);
+    const_value_table_values.swap(snap_const_value_table_values);
+
+    // Each address keeps the name bound to it last, same as the scan left it
+    for (auto& pair : unresolved_syms_rev)
+        import_bind(pair.first, pair.second);
+    for (auto& pair : resolved_syms_rev)
+        import_bind(pair.first, pair.second);
+    syms_scanned = true;
+
+    ClusterManager* cluster = new ClusterManager(nro_image, import_image);
+    EmuInstance* inst = cluster->get_inst();
+
+    // Pooled slabs aren't zeroed, clear what the copy doesn't cover
+    inst->set_heap_size(heap_size);
+    memcpy(inst->uc_ptr_to_real_ptr(HEAP), heap, heap_used);
+    memset((char*)inst->uc_ptr_to_real_ptr(HEAP) + heap_used, 0, HEAP_SIZE - heap_used);
+    memcpy(inst->uc_ptr_to_real_ptr(STACK), stack, STACK_SIZE);
+    memcpy(&inst->regs_cur, regs, sizeof(inst->regs_cur));
+    inst->sp_part1 = sp_part1;
+    inst->sp_part2 = sp_part2;
+    inst->last_crcs.swap(last_crcs);
+    inst->lua_stack.swap(lua_stack);
+
+    munmap(data, st.st_size);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - time_start;
+    printf_info("Loaded startup snapshot %016" PRIx64 " from %s in %.3fms\n", key, path.c_str(), elapsed.count());
+    return cluster;
+}
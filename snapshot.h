@@ -0,0 +1,21 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <string>
+
+class ClusterManager;
+
+// Startup state saved after agent setup: the relocated NRO and IMPORTS, the
+// symbol and agent tables, registered function hashes and the base instance's
+// heap and stack. A warm run loads it in place of scanning, relocating and
+// creating agents again.
+//
+// The key covers the NRO, the string and const tables read at startup, the
+// options setup depends on and the binary itself, a snapshot with any other
+// key is ignored.
+uint64_t snapshot_key(const std::string& nro_path);
+bool snapshot_save(const std::string& path, uint64_t key, ClusterManager* cluster);
+ClusterManager* snapshot_load(const std::string& path, uint64_t key);
+
+#endif // SNAPSHOT_H
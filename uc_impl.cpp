@@ -1,6 +1,11 @@
+#include <cstddef>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 
 #include "uc_impl.h"
 
@@ -11,150 +16,162 @@
 std::map<uint64_t, uint64_t> hash_cheat;
 std::map<uint64_t, uint64_t> hash_cheat_rev;
 uint64_t hash_cheat_ptr;
-uint32_t sp_part1, sp_part2;
 
-void uc_read_reg_state(uc_engine *uc, struct uc_reg_state *regs)
+// Handlers run outside the cluster's state lock, these globals are shared by all of them
+static std::mutex import_globals_lock;
+
+static const std::unordered_map<std::string, ImportHandler> import_handlers = {
+    {"operator new(unsigned long)", ImportHandler_OperatorNew},
+    {"lib::L2CAgent::sv_set_function_hash(void*, phx::Hash40)", ImportHandler_SetFunctionHash},
+    {"lua2cpp::L2CAgentBase::sv_set_status_func(lib::L2CValue const&, lib::L2CValue const&, void*)", ImportHandler_SetStatusFunc},
+    {"lib::utility::Variadic::get_format() const", ImportHandler_VariadicGetFormat},
+    {"lib::L2CAgent::clear_lua_stack()", ImportHandler_ClearLuaStack},
+    {"app::sv_animcmd::is_excute(lua_State*)", ImportHandler_IsExcute},
+    {"app::sv_animcmd::frame(lua_State*, float)", ImportHandler_Frame},
+    {"lib::L2CAgent::pop_lua_stack(int)", ImportHandler_PopLuaStack},
+    {"lib::L2CAgent::push_lua_stack(lib::L2CValue const&)", ImportHandler_PushLuaStack},
+    {"lib::L2CValue::L2CValue(int)", ImportHandler_ValueInt},
+    {"lib::L2CValue::L2CValue(long)", ImportHandler_ValueLong},
+    {"lib::L2CValue::L2CValue(unsigned int)", ImportHandler_ValueUnsigned},
+    {"lib::L2CValue::L2CValue(unsigned long)", ImportHandler_ValueUnsigned},
+    {"lib::L2CValue::L2CValue(bool)", ImportHandler_ValueBool},
+    {"lib::L2CValue::L2CValue(phx::Hash40)", ImportHandler_ValueHash},
+    {"lib::L2CValue::L2CValue(void*)", ImportHandler_ValuePointer},
+    {"lib::L2CValue::L2CValue(float)", ImportHandler_ValueFloat},
+    {"lib::L2CValue::L2CValue(lib::L2CValue const&)", ImportHandler_ValueCopy},
+    {"lib::L2CValue::as_number() const", ImportHandler_AsNumber},
+    {"lib::L2CValue::as_bool() const", ImportHandler_AsBool},
+    {"lib::L2CValue::as_integer() const", ImportHandler_AsInteger},
+    {"lib::L2CValue::as_pointer() const", ImportHandler_AsPointer},
+    {"lib::L2CValue::as_table() const", ImportHandler_AsTable},
+    {"lib::L2CValue::as_inner_function() const", ImportHandler_AsInnerFunction},
+    {"lib::L2CValue::as_hash() const", ImportHandler_AsHash},
+    {"lib::L2CValue::as_string() const", ImportHandler_AsString},
+    {"lib::L2CValue::~L2CValue()", ImportHandler_ValueDestruct},
+    {"lib::L2CValue::operator[](phx::Hash40) const", ImportHandler_IndexHash},
+    {"lib::L2CValue::operator[](int) const", ImportHandler_IndexInt},
+    {"lib::L2CValue::operator=(lib::L2CValue const&)", ImportHandler_Assign},
+    {"lib::L2CValue::operator bool() const", ImportHandler_Compare},
+    {"lib::L2CValue::operator==(lib::L2CValue const&) const", ImportHandler_Compare},
+    {"lib::L2CValue::operator<=(lib::L2CValue const&) const", ImportHandler_Compare},
+    {"lib::L2CValue::operator<(lib::L2CValue const&) const", ImportHandler_Compare},
+};
+
+// One slot per 8 bytes of IMPORTS, symbols inside the NRO go in a map since
+// only a couple of them ever get hooked. Both are filled in before any
+// cluster starts running and only read afterwards.
+static std::vector<ImportEntry> import_table(IMPORTS_SIZE / 8);
+static std::unordered_map<uint64_t, ImportEntry> nro_import_table;
+
+void import_bind(uint64_t addr, const std::string& name)
 {
-    uc_reg_read(uc, UC_ARM64_REG_X0, &regs->x0);
-    uc_reg_read(uc, UC_ARM64_REG_X1, &regs->x1);
-    uc_reg_read(uc, UC_ARM64_REG_X2, &regs->x2);
-    uc_reg_read(uc, UC_ARM64_REG_X3, &regs->x3);
-    uc_reg_read(uc, UC_ARM64_REG_X4, &regs->x4);
-    uc_reg_read(uc, UC_ARM64_REG_X5, &regs->x5);
-    uc_reg_read(uc, UC_ARM64_REG_X6, &regs->x6);
-    uc_reg_read(uc, UC_ARM64_REG_X7, &regs->x7);
-    uc_reg_read(uc, UC_ARM64_REG_X8, &regs->x8);
-    uc_reg_read(uc, UC_ARM64_REG_X9, &regs->x9);
-    uc_reg_read(uc, UC_ARM64_REG_X10, &regs->x10);
-    uc_reg_read(uc, UC_ARM64_REG_X11, &regs->x11);
-    uc_reg_read(uc, UC_ARM64_REG_X12, &regs->x12);
-    uc_reg_read(uc, UC_ARM64_REG_X13, &regs->x13);
-    uc_reg_read(uc, UC_ARM64_REG_X14, &regs->x14);
-    uc_reg_read(uc, UC_ARM64_REG_X15, &regs->x15);
-    uc_reg_read(uc, UC_ARM64_REG_X16, &regs->x16);
-    uc_reg_read(uc, UC_ARM64_REG_X17, &regs->x17);
-    uc_reg_read(uc, UC_ARM64_REG_X18, &regs->x18);
-    uc_reg_read(uc, UC_ARM64_REG_X19, &regs->x19);
-    uc_reg_read(uc, UC_ARM64_REG_X20, &regs->x20);
-    uc_reg_read(uc, UC_ARM64_REG_X21, &regs->x21);
-    uc_reg_read(uc, UC_ARM64_REG_X22, &regs->x22);
-    uc_reg_read(uc, UC_ARM64_REG_X23, &regs->x23);
-    uc_reg_read(uc, UC_ARM64_REG_X24, &regs->x24);
-    uc_reg_read(uc, UC_ARM64_REG_X25, &regs->x25);
-    uc_reg_read(uc, UC_ARM64_REG_X26, &regs->x26);
-    uc_reg_read(uc, UC_ARM64_REG_X27, &regs->x27);
-    uc_reg_read(uc, UC_ARM64_REG_X28, &regs->x28);
-    uc_reg_read(uc, UC_ARM64_REG_FP, &regs->fp);
-    uc_reg_read(uc, UC_ARM64_REG_LR, &regs->lr);
-    uc_reg_read(uc, UC_ARM64_REG_SP, &regs->sp);
-    uc_reg_read(uc, UC_ARM64_REG_PC, &regs->pc);
-    uc_reg_read(uc, UC_ARM64_REG_NZCV, &regs->nzcv);
-    uc_reg_read(uc, UC_ARM64_REG_CPACR_EL1, &regs->cpacr_el1);
+    ImportEntry entry;
+    entry.sym = l2c_intern(name);
+    
+    auto handler = import_handlers.find(name);
+    entry.handler = handler != import_handlers.end() ? handler->second : ImportHandler_Record;
     
-    uc_reg_read(uc, UC_ARM64_REG_S0, &regs->s0);
-    uc_reg_read(uc, UC_ARM64_REG_S1, &regs->s1);
-    uc_reg_read(uc, UC_ARM64_REG_S2, &regs->s2);
-    uc_reg_read(uc, UC_ARM64_REG_S3, &regs->s3);
-    uc_reg_read(uc, UC_ARM64_REG_S4, &regs->s4);
-    uc_reg_read(uc, UC_ARM64_REG_S5, &regs->s5);
-    uc_reg_read(uc, UC_ARM64_REG_S6, &regs->s6);
-    uc_reg_read(uc, UC_ARM64_REG_S7, &regs->s7);
-    uc_reg_read(uc, UC_ARM64_REG_S8, &regs->s8);
-    uc_reg_read(uc, UC_ARM64_REG_S9, &regs->s9);
-    uc_reg_read(uc, UC_ARM64_REG_S10, &regs->s10);
-    uc_reg_read(uc, UC_ARM64_REG_S11, &regs->s11);
-    uc_reg_read(uc, UC_ARM64_REG_S12, &regs->s12);
-    uc_reg_read(uc, UC_ARM64_REG_S13, &regs->s13);
-    uc_reg_read(uc, UC_ARM64_REG_S14, &regs->s14);
-    uc_reg_read(uc, UC_ARM64_REG_S15, &regs->s15);
-    uc_reg_read(uc, UC_ARM64_REG_S16, &regs->s16);
-    uc_reg_read(uc, UC_ARM64_REG_S17, &regs->s17);
-    uc_reg_read(uc, UC_ARM64_REG_S18, &regs->s18);
-    uc_reg_read(uc, UC_ARM64_REG_S19, &regs->s19);
-    uc_reg_read(uc, UC_ARM64_REG_S20, &regs->s20);
-    uc_reg_read(uc, UC_ARM64_REG_S21, &regs->s21);
-    uc_reg_read(uc, UC_ARM64_REG_S22, &regs->s22);
-    uc_reg_read(uc, UC_ARM64_REG_S23, &regs->s23);
-    uc_reg_read(uc, UC_ARM64_REG_S24, &regs->s24);
-    uc_reg_read(uc, UC_ARM64_REG_S25, &regs->s25);
-    uc_reg_read(uc, UC_ARM64_REG_S26, &regs->s26);
-    uc_reg_read(uc, UC_ARM64_REG_S27, &regs->s27);
-    uc_reg_read(uc, UC_ARM64_REG_S28, &regs->s28);
-    uc_reg_read(uc, UC_ARM64_REG_S29, &regs->s29);
-    uc_reg_read(uc, UC_ARM64_REG_S30, &regs->s30);
-    uc_reg_read(uc, UC_ARM64_REG_S31, &regs->s31);
+    if (addr >= IMPORTS && addr < IMPORTS_END)
+        import_table[(addr - IMPORTS) / 8] = entry;
+    else
+        nro_import_table[addr] = entry;
+}
+
+static ImportEntry import_lookup(uint64_t addr)
+{
+    if (addr >= IMPORTS && addr < IMPORTS_END)
+        return import_table[(addr - IMPORTS) / 8];
+
+    auto iter = nro_import_table.find(addr);
+    if (iter == nro_import_table.end()) return ImportEntry();
+
+    return iter->second;
+}
+
+#define REG_DESC(id, field) { UC_ARM64_REG_##id, offsetof(uc_reg_state, field), sizeof(uc_reg_state::field) }
+
+struct uc_reg_desc
+{
+    int id;
+    size_t offset;
+    size_t size;
+};
+
+// Kept in uc_reg_state order. S registers are 4 bytes and only fill the
+// low half of their 8 byte field.
+static const uc_reg_desc uc_reg_descs[] = {
+    REG_DESC(PC, pc), REG_DESC(LR, lr), REG_DESC(SP, sp),
+    REG_DESC(X0, x0), REG_DESC(X1, x1), REG_DESC(X2, x2), REG_DESC(X3, x3),
+    REG_DESC(X4, x4), REG_DESC(X5, x5), REG_DESC(X6, x6), REG_DESC(X7, x7),
+    REG_DESC(X8, x8),
+    REG_DESC(S0, s0), REG_DESC(S1, s1), REG_DESC(S2, s2), REG_DESC(S3, s3),
+    REG_DESC(S4, s4), REG_DESC(S5, s5), REG_DESC(S6, s6), REG_DESC(S7, s7),
+    REG_DESC(S8, s8), REG_DESC(S9, s9), REG_DESC(S10, s10), REG_DESC(S11, s11),
+    REG_DESC(S12, s12), REG_DESC(S13, s13), REG_DESC(S14, s14), REG_DESC(S15, s15),
+    REG_DESC(S16, s16), REG_DESC(S17, s17), REG_DESC(S18, s18), REG_DESC(S19, s19),
+    REG_DESC(S20, s20), REG_DESC(S21, s21), REG_DESC(S22, s22), REG_DESC(S23, s23),
+    REG_DESC(S24, s24), REG_DESC(S25, s25), REG_DESC(S26, s26), REG_DESC(S27, s27),
+    REG_DESC(S28, s28), REG_DESC(S29, s29), REG_DESC(S30, s30), REG_DESC(S31, s31),
+    REG_DESC(X9, x9), REG_DESC(X10, x10), REG_DESC(X11, x11), REG_DESC(X12, x12),
+    REG_DESC(X13, x13), REG_DESC(X14, x14), REG_DESC(X15, x15), REG_DESC(X16, x16),
+    REG_DESC(X17, x17), REG_DESC(X18, x18), REG_DESC(X19, x19), REG_DESC(X20, x20),
+    REG_DESC(X21, x21), REG_DESC(X22, x22), REG_DESC(X23, x23), REG_DESC(X24, x24),
+    REG_DESC(X25, x25), REG_DESC(X26, x26), REG_DESC(X27, x27), REG_DESC(X28, x28),
+    REG_DESC(FP, fp), REG_DESC(NZCV, nzcv), REG_DESC(CPACR_EL1, cpacr_el1),
+};
+
+#define UC_NUM_REGS (sizeof(uc_reg_descs) / sizeof(uc_reg_descs[0]))
+
+void uc_read_reg_state(uc_engine *uc, struct uc_reg_state *regs)
+{
+    int ids[UC_NUM_REGS];
+    void* vals[UC_NUM_REGS];
+
+    for (size_t i = 0; i < UC_NUM_REGS; i++)
+    {
+        ids[i] = uc_reg_descs[i].id;
+        vals[i] = (uint8_t*)regs + uc_reg_descs[i].offset;
+    }
+
+    uc_reg_read_batch(uc, ids, vals, UC_NUM_REGS);
 }
 
 void uc_write_reg_state(uc_engine *uc, struct uc_reg_state *regs)
 {
-    uc_reg_write(uc, UC_ARM64_REG_X0, &regs->x0);
-    uc_reg_write(uc, UC_ARM64_REG_X1, &regs->x1);
-    uc_reg_write(uc, UC_ARM64_REG_X2, &regs->x2);
-    uc_reg_write(uc, UC_ARM64_REG_X3, &regs->x3);
-    uc_reg_write(uc, UC_ARM64_REG_X4, &regs->x4);
-    uc_reg_write(uc, UC_ARM64_REG_X5, &regs->x5);
-    uc_reg_write(uc, UC_ARM64_REG_X6, &regs->x6);
-    uc_reg_write(uc, UC_ARM64_REG_X7, &regs->x7);
-    uc_reg_write(uc, UC_ARM64_REG_X8, &regs->x8);
-    uc_reg_write(uc, UC_ARM64_REG_X9, &regs->x9);
-    uc_reg_write(uc, UC_ARM64_REG_X10, &regs->x10);
-    uc_reg_write(uc, UC_ARM64_REG_X11, &regs->x11);
-    uc_reg_write(uc, UC_ARM64_REG_X12, &regs->x12);
-    uc_reg_write(uc, UC_ARM64_REG_X13, &regs->x13);
-    uc_reg_write(uc, UC_ARM64_REG_X14, &regs->x14);
-    uc_reg_write(uc, UC_ARM64_REG_X15, &regs->x15);
-    uc_reg_write(uc, UC_ARM64_REG_X16, &regs->x16);
-    uc_reg_write(uc, UC_ARM64_REG_X17, &regs->x17);
-    uc_reg_write(uc, UC_ARM64_REG_X18, &regs->x18);
-    uc_reg_write(uc, UC_ARM64_REG_X19, &regs->x19);
-    uc_reg_write(uc, UC_ARM64_REG_X20, &regs->x20);
-    uc_reg_write(uc, UC_ARM64_REG_X21, &regs->x21);
-    uc_reg_write(uc, UC_ARM64_REG_X22, &regs->x22);
-    uc_reg_write(uc, UC_ARM64_REG_X23, &regs->x23);
-    uc_reg_write(uc, UC_ARM64_REG_X24, &regs->x24);
-    uc_reg_write(uc, UC_ARM64_REG_X25, &regs->x25);
-    uc_reg_write(uc, UC_ARM64_REG_X26, &regs->x26);
-    uc_reg_write(uc, UC_ARM64_REG_X27, &regs->x27);
-    uc_reg_write(uc, UC_ARM64_REG_X28, &regs->x28);
-    uc_reg_write(uc, UC_ARM64_REG_FP, &regs->fp);
-    uc_reg_write(uc, UC_ARM64_REG_LR, &regs->lr);
-    uc_reg_write(uc, UC_ARM64_REG_SP, &regs->sp);
-    uc_reg_write(uc, UC_ARM64_REG_PC, &regs->pc);
-    uc_reg_write(uc, UC_ARM64_REG_NZCV, &regs->nzcv);
-    uc_reg_write(uc, UC_ARM64_REG_CPACR_EL1, &regs->cpacr_el1);
-    
-    uc_reg_write(uc, UC_ARM64_REG_S0, &regs->s0);
-    uc_reg_write(uc, UC_ARM64_REG_S1, &regs->s1);
-    uc_reg_write(uc, UC_ARM64_REG_S2, &regs->s2);
-    uc_reg_write(uc, UC_ARM64_REG_S3, &regs->s3);
-    uc_reg_write(uc, UC_ARM64_REG_S4, &regs->s4);
-    uc_reg_write(uc, UC_ARM64_REG_S5, &regs->s5);
-    uc_reg_write(uc, UC_ARM64_REG_S6, &regs->s6);
-    uc_reg_write(uc, UC_ARM64_REG_S7, &regs->s7);
-    uc_reg_write(uc, UC_ARM64_REG_S8, &regs->s8);
-    uc_reg_write(uc, UC_ARM64_REG_S9, &regs->s9);
-    uc_reg_write(uc, UC_ARM64_REG_S10, &regs->s10);
-    uc_reg_write(uc, UC_ARM64_REG_S11, &regs->s11);
-    uc_reg_write(uc, UC_ARM64_REG_S12, &regs->s12);
-    uc_reg_write(uc, UC_ARM64_REG_S13, &regs->s13);
-    uc_reg_write(uc, UC_ARM64_REG_S14, &regs->s14);
-    uc_reg_write(uc, UC_ARM64_REG_S15, &regs->s15);
-    uc_reg_write(uc, UC_ARM64_REG_S16, &regs->s16);
-    uc_reg_write(uc, UC_ARM64_REG_S17, &regs->s17);
-    uc_reg_write(uc, UC_ARM64_REG_S18, &regs->s18);
-    uc_reg_write(uc, UC_ARM64_REG_S19, &regs->s19);
-    uc_reg_write(uc, UC_ARM64_REG_S20, &regs->s20);
-    uc_reg_write(uc, UC_ARM64_REG_S21, &regs->s21);
-    uc_reg_write(uc, UC_ARM64_REG_S22, &regs->s22);
-    uc_reg_write(uc, UC_ARM64_REG_S23, &regs->s23);
-    uc_reg_write(uc, UC_ARM64_REG_S24, &regs->s24);
-    uc_reg_write(uc, UC_ARM64_REG_S25, &regs->s25);
-    uc_reg_write(uc, UC_ARM64_REG_S26, &regs->s26);
-    uc_reg_write(uc, UC_ARM64_REG_S27, &regs->s27);
-    uc_reg_write(uc, UC_ARM64_REG_S28, &regs->s28);
-    uc_reg_write(uc, UC_ARM64_REG_S29, &regs->s29);
-    uc_reg_write(uc, UC_ARM64_REG_S30, &regs->s30);
-    uc_reg_write(uc, UC_ARM64_REG_S31, &regs->s31);
+    int ids[UC_NUM_REGS];
+    void* vals[UC_NUM_REGS];
+
+    for (size_t i = 0; i < UC_NUM_REGS; i++)
+    {
+        ids[i] = uc_reg_descs[i].id;
+        vals[i] = (uint8_t*)regs + uc_reg_descs[i].offset;
+    }
+
+    uc_reg_write_batch(uc, ids, vals, UC_NUM_REGS);
+}
+
+void uc_sync_reg_state(uc_engine *uc, struct uc_reg_state *regs, struct uc_reg_state *known)
+{
+    int ids[UC_NUM_REGS];
+    void* vals[UC_NUM_REGS];
+    int count = 0;
+
+    // Only registers which differ from what the engine holds get written
+    for (size_t i = 0; i < UC_NUM_REGS; i++)
+    {
+        uint8_t* val = (uint8_t*)regs + uc_reg_descs[i].offset;
+        uint8_t* known_val = (uint8_t*)known + uc_reg_descs[i].offset;
+
+        if (!memcmp(val, known_val, uc_reg_descs[i].size)) continue;
+
+        memcpy(known_val, val, uc_reg_descs[i].size);
+        ids[count] = uc_reg_descs[i].id;
+        vals[count] = val;
+        count++;
+    }
+
+    if (count)
+        uc_reg_write_batch(uc, ids, vals, count);
 }
 
 void uc_print_regs(uc_engine *uc)
@@ -252,15 +269,16 @@ void uc_print_regs(uc_engine *uc)
     printf("\n");
 }
 
-void hook_code(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager* cluster)
+void hook_code(uc_engine *uc, uint64_t address, uint32_t size, EmuEngine* engine)
 {
-    EmuInstance* inst = cluster->get_running_inst();
+    EmuInstance* inst = engine->get_running_inst();
     static uint64_t last_pc[2];
 
     if (last_pc[0] == address && last_pc[0] == last_pc[1] && !inst->is_term())
     {
         printf_warn("Hang at 0x%" PRIx64 " ?\n", address);
         inst->terminate();
+        uc_emu_stop(uc);
     }
 
     if (trace_code && !inst->is_term())
@@ -273,14 +291,18 @@ void hook_code(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager* c
     last_pc[0] = address;
 }
 
-void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager* cluster)
+void hook_import(uc_engine *uc, uint64_t address, uint32_t size, EmuEngine* engine)
 {
     uint64_t origin, origin_block;
-    std::string name = unresolved_syms_rev[address];
-    if (name == "") {
-        name = resolved_syms_rev[address];
-    }
-    EmuInstance* inst = cluster->get_running_inst();
+    ImportEntry import = import_lookup(address);
+    if (!import.sym) return;
+
+    ClusterManager* cluster = engine->get_cluster();
+    std::unique_lock<std::recursive_mutex> lock(cluster->get_state_mutex());
+
+    const std::string& name = l2c_sym_name(import.sym);
+    EmuInstance* inst = engine->get_running_inst();
+    engine->regs_stale();
     inst->regs_invalidate();
     
     origin = inst->get_jump_history();
@@ -294,34 +316,35 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
     L2C_Token token;
     token.pc = origin;
     token.fork_hierarchy = inst->get_fork_hierarchy();
-    token.str = name;
+    token.sym = import.sym;
     token.type = L2C_TokenType_Func;
 
-    if (!inst->is_basic_emu() && cluster->converge_points[origin] && inst->has_parent() && inst->get_start_addr())
+    if (!inst->is_basic_emu() && cluster->is_converge_point(origin) && inst->has_parent() && inst->get_start_addr())
     {
         // Don't terminate if the token at the convergence point has a larger fork hierarchy
         // Too large a fork hierarchy just means one of the forks got ahead of the root
         // instance and the tokens will be replaced by correct values.
         bool should_term = false;
         uint64_t term_block = 0;
-        for (auto& pair : cluster->tokens)
+        for (uint64_t block : cluster->token_blocks_at(origin))
         {
-            for (auto& t : pair.second)
+            auto range = cluster->block_tokens_at(block, origin);
+            for (auto iter = range.first; iter != range.second; iter++)
             {
-                //if (t.pc == origin)
-                    //printf("conv %u: %llx %s %zx %zx\n", inst->get_id(), t.pc, t.str.c_str(), token.fork_hierarchy.size(), t.fork_hierarchy.size());
-                if (t.pc == origin && (t.type == L2C_TokenType_Func || t.type == L2C_TokenType_Branch))
+                auto& t = *iter;
+                //printf("conv %u: %llx %s %zx %zx\n", inst->get_id(), t.pc, t.name().c_str(), token.fork_hierarchy.size(), t.fork_hierarchy.size());
+                if (t.type == L2C_TokenType_Func || t.type == L2C_TokenType_Branch)
                 {
                     if (token.fork_hierarchy.size() > t.fork_hierarchy.size())
                     {
-                        //printf("doconv %u: %llx %s\n", inst->get_id(), t.pc, t.str.c_str());
+                        //printf("doconv %u: %llx %s\n", inst->get_id(), t.pc, t.name().c_str());
                         should_term = true;
-                        term_block = pair.first;
+                        term_block = block;
                     }
                     else if (token.fork_hierarchy.size() == t.fork_hierarchy.size())
                     {
                         should_term = token.fork_hierarchy[0] >= t.fork_hierarchy[0];
-                        term_block = pair.first;
+                        term_block = block;
                     }
                 }
                 
@@ -340,7 +363,7 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
                 printf_warn("Instance Id %u: Convergence block is not the same as current block (%" PRIx64 ", %" PRIx64 ")...\n", inst->get_id(), origin_block, term_block);
             }
             
-            token.str = "CONV";
+            token.sym = L2C_TokenSym_Conv;
             token.type = L2C_TokenType_Meta;
             
             token.args.push_back(origin);
@@ -351,19 +374,22 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
             if (inst->num_outputted_tokens())
                 cluster->add_token_by_prio(origin_block, token);
             inst->terminate();
+            uc_emu_stop(uc);
             return;
         }
     }
 
     bool add_token = false;
-    if (!inst->is_basic_emu() && cluster->converge_points[origin])
+    if (!inst->is_basic_emu() && cluster->is_converge_point(origin))
     {
-        for (auto& pair : cluster->tokens)
+        for (uint64_t block : cluster->token_blocks_at(origin))
         {
             std::set<L2C_Token> to_erase;
-            for (auto& t : pair.second)
+            auto range = cluster->block_tokens_at(block, origin);
+            for (auto iter = range.first; iter != range.second; iter++)
             {
-                if (t.pc == origin && t.type == L2C_TokenType_Func)
+                auto& t = *iter;
+                if (t.type == L2C_TokenType_Func)
                 {
                     if (token.fork_hierarchy.size() < t.fork_hierarchy.size())
                     {
@@ -381,7 +407,7 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
             
             for (auto& t : to_erase)
             {
-                pair.second.erase(t);
+                cluster->erase_token(block, t);
             }
         }
     }
@@ -390,6 +416,7 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
         add_token = true;
     }
 
+    // Complete the call in place, Unicorn resumes at LR without leaving uc_emu_start
     inst->set_pc(inst->get_lr());
     inst->regs_flush();
     
@@ -416,418 +443,466 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
     fargs[7] = inst->regs_cur.s7;
     fargs[8] = inst->regs_cur.s8;
 
-    cluster->converge_points[origin] = true;
+    cluster->set_converge_point(origin);
+    
+    // Handlers only touch this instance, so sibling forks aren't held up on them
+    lock.unlock();
     
-    if (name == "operator new(unsigned long)")
+    switch (import.handler)
     {
-        uint64_t alloc = inst->heap_alloc(args[0]);
+        case ImportHandler_OperatorNew:
+        {
+            uint64_t alloc = inst->heap_alloc(args[0]);
         
-        //TODO
-        if (args[0] > 0x48)
-            hash_cheat_ptr = alloc;
+            //TODO
+            if (args[0] > 0x48)
+            {
+                std::lock_guard<std::mutex> globals_lock(import_globals_lock);
+                hash_cheat_ptr = alloc;
+            }
         
-        args[0] = alloc;
-    }
-    else if (name == "lib::L2CAgent::sv_set_function_hash(void*, phx::Hash40)")
-    {
-        printf_info("Instance Id %u: lib::L2CAgent::sv_set_function_hash(0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ") %s\n", inst->get_id(), args[0], args[1], args[2], unhash[args[2]].c_str());
+            args[0] = alloc;
+            break;
+        }
+        case ImportHandler_SetFunctionHash:
+        {
+            printf_info("Instance Id %u: lib::L2CAgent::sv_set_function_hash(0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ") %s\n", inst->get_id(), args[0], args[1], args[2], unhash_find(args[2]).c_str());
         
-        function_hashes[std::pair<uint64_t, uint64_t>(args[0], args[2])] = args[1];
-    }
-    else if (name == "lua2cpp::L2CAgentBase::sv_set_status_func(lib::L2CValue const&, lib::L2CValue const&, void*)")
-    {
-        char tmp[256];
-        L2CValue* a = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
-        L2CValue* b = (L2CValue*)inst->uc_ptr_to_real_ptr(args[2]);
-        uint64_t funcptr = args[3];
+            std::lock_guard<std::mutex> globals_lock(import_globals_lock);
+            function_hashes[std::pair<uint64_t, uint64_t>(args[0], args[2])] = args[1];
+            break;
+        }
+        case ImportHandler_SetStatusFunc:
+        {
+            char tmp[256];
+            L2CValue* a = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
+            L2CValue* b = (L2CValue*)inst->uc_ptr_to_real_ptr(args[2]);
+            uint64_t funcptr = args[3];
 
-        uint64_t a_raw = (uint64_t) a->as_integer();
-        uint64_t b_raw = (uint64_t) b->as_integer();
+            uint64_t a_raw = (uint64_t) a->as_integer();
+            uint64_t b_raw = (uint64_t) b->as_integer();
         
-        uint64_t statusconcat = a_raw << 32 | b_raw;
-        std::string kind;
-        std::string func;
+            uint64_t statusconcat = a_raw << 32 | b_raw;
+            std::string kind;
+            std::string func;
 
-        kind = const_value_table[a_raw].substr(strlen("FIGHTER_STATUS_KIND_"));
-        func = const_value_table[b_raw].substr(strlen("LUA_SCRIPT_STATUS_FUNC_"));
+            kind = const_value_table[a_raw].substr(strlen("FIGHTER_STATUS_KIND_"));
+            func = const_value_table[b_raw].substr(strlen("LUA_SCRIPT_STATUS_FUNC_"));
 
-        // if (kind == "SPECIAL_S" && func == "STATUS_MAIN")
-        {
-            std::string func_str = kind + "__" + func;
-            status_funcs[statusconcat] = func_str;
+            // if (kind == "SPECIAL_S" && func == "STATUS_MAIN")
+            {
+                std::string func_str = kind + "__" + func;
+                std::lock_guard<std::mutex> globals_lock(import_globals_lock);
+                status_funcs[statusconcat] = func_str;
             
-            printf("Instance Id %u: lua2cpp::L2CAgentBase::sv_set_status_func(0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ") -> %s,%10" PRIx64 "\n", inst->get_id(), args[0], a_raw, b_raw, funcptr, func_str.c_str(), statusconcat);
+                printf("Instance Id %u: lua2cpp::L2CAgentBase::sv_set_status_func(0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ") -> %s,%10" PRIx64 "\n", inst->get_id(), args[0], a_raw, b_raw, funcptr, func_str.c_str(), statusconcat);
             
-            function_hashes[std::pair<uint64_t, uint64_t>(args[0], statusconcat)] = funcptr;
+                function_hashes[std::pair<uint64_t, uint64_t>(args[0], statusconcat)] = funcptr;
+            }
+            break;
         }
-    }
-    // else if (name.find("app::lua_bind") != std::string::npos)
-    // {
-        // size_t arg_start = name.find("(") + 1;
-        // size_t arg_end = name.find(")");
-        // std::stringstream ss(name.substr(arg_start, arg_end - arg_start));
-        // std::string arg;
-        // size_t j = 0;
-        // while (std::getline(ss, arg, ',')) {
-        //     if (arg == " int") {
-        //         token.args.push_back(args[j]);
-        //     } else if (arg == " float") {
-        //         token.fargs.push_back(args[j]);
-        //     }
-
-        //     j++;
-        // }
-    // }
-    else if (name == "lib::utility::Variadic::get_format() const")
-    {
-        args[0] = 0;
-    }
-    else if (name == "lib::L2CAgent::clear_lua_stack()")
-    {
-        inst->lua_stack = std::vector<L2CValue>();
-    }
-    else if (name == "app::sv_animcmd::is_excute(lua_State*)")
-    {
-        inst->lua_stack.push_back(L2CValue(true));
-    }
-    else if (name == "app::sv_animcmd::frame(lua_State*, float)")
-    {
-        //token.args.push_back(args[0]);
-        token.fargs.push_back(fargs[0]);
+        // else if (name.find("app::lua_bind") != std::string::npos)
+        // {
+            // size_t arg_start = name.find("(") + 1;
+            // size_t arg_end = name.find(")");
+            // std::stringstream ss(name.substr(arg_start, arg_end - arg_start));
+            // std::string arg;
+            // size_t j = 0;
+            // while (std::getline(ss, arg, ',')) {
+            //     if (arg == " int") {
+            //         token.args.push_back(args[j]);
+            //     } else if (arg == " float") {
+            //         token.fargs.push_back(args[j]);
+            //     }
 
-        inst->lua_stack.push_back(L2CValue(true));
-    }
-    else if (name == "lib::L2CAgent::pop_lua_stack(int)")
-    {
-        token.args.push_back(args[1]);
-    
-        L2CValue* out = (L2CValue*)inst->uc_ptr_to_real_ptr(args[8]);
-        L2CValue* iter = out;
+            //     j++;
+            // }
+        // }
+        case ImportHandler_VariadicGetFormat:
+        {
+            args[0] = 0;
+            break;
+        }
+        case ImportHandler_ClearLuaStack:
+        {
+            inst->lua_stack = std::vector<L2CValue>();
+            break;
+        }
+        case ImportHandler_IsExcute:
+        {
+            inst->lua_stack.push_back(L2CValue(true));
+            break;
+        }
+        case ImportHandler_Frame:
+        {
+            //token.args.push_back(args[0]);
+            token.fargs.push_back(fargs[0]);
 
-        for (int i = 0; i < args[1]; i++)
+            inst->lua_stack.push_back(L2CValue(true));
+            break;
+        }
+        case ImportHandler_PopLuaStack:
         {
-            if (!out) break;
+            token.args.push_back(args[1]);
+    
+            L2CValue* out = (L2CValue*)inst->uc_ptr_to_real_ptr(args[8]);
+            L2CValue* iter = out;
 
-            if (inst->lua_stack.size())
+            for (int i = 0; i < args[1]; i++)
             {
-                *iter = *(inst->lua_stack.end() - 1);
-                inst->lua_stack.pop_back();
-            }
-            else
-            {
-                //printf_warn("Instance Id %u: Bad stack pop...\n", inst->get_id());
+                if (!out) break;
+
+                if (inst->lua_stack.size())
+                {
+                    *iter = *(inst->lua_stack.end() - 1);
+                    inst->lua_stack.pop_back();
+                }
+                else
+                {
+                    //printf_warn("Instance Id %u: Bad stack pop...\n", inst->get_id());
                 
-                L2CValue empty();
-                *iter = empty;
-            }
+                    L2CValue empty();
+                    *iter = empty;
+                }
 
-            iter++;
-        }
-        
-        //inst->lua_active_vars[args[8]] = out;
-    }
-    else if (name == "lib::L2CAgent::push_lua_stack(lib::L2CValue const&)")
-    {
-        L2CValue* val = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
+                iter++;
+            }
         
-        if (val)
+            //inst->lua_active_vars[args[8]] = out;
+            break;
+        }
+        case ImportHandler_PushLuaStack:
         {
-            token.args.push_back(val->type);
-            if (val->type != L2C_number)
+            L2CValue* val = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
+        
+            if (val)
             {
-                token.args.push_back(val->raw);
+                token.args.push_back(val->type);
+                if (val->type != L2C_number)
+                {
+                    token.args.push_back(val->raw);
+                }
+                else
+                {
+                    token.fargs.push_back(val->as_number());
+                }
+            
             }
+            break;
+        }
+        case ImportHandler_ValueInt:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue((int)args[1]);
             else
-            {
-                token.fargs.push_back(val->as_number());
-            }
-            
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+
+            token.args.push_back(var->as_integer());
+            if (var->unk == 0xBABE)
+                token.arg_is_const_value.push_back(token.args.size()-1);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
         }
-    }
-    else if (name == "lib::L2CValue::L2CValue(int)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue((int)args[1]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-
-        token.args.push_back(var->as_integer());
-        if (var->unk == 0xBABE)
-            token.arg_is_const_value.push_back(token.args.size()-1);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(long)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue((long)args[1]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+        case ImportHandler_ValueLong:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue((long)args[1]);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
     
-        token.args.push_back((long)args[1]);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(unsigned int)"
-             || name == "lib::L2CValue::L2CValue(unsigned long)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue(args[1]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            token.args.push_back((long)args[1]);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValueUnsigned:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue(args[1]);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
     
-        token.args.push_back(args[1]);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(bool)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue((bool)args[1]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            token.args.push_back(args[1]);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValueBool:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue((bool)args[1]);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
     
-        token.args.push_back((int)args[1]);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(phx::Hash40)")
-    {
-        Hash40 hash = {args[1] & 0xFFFFFFFFFF};
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue(hash);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            token.args.push_back((int)args[1]);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValueHash:
+        {
+            Hash40 hash = {args[1] & 0xFFFFFFFFFF};
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue(hash);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
         
-        token.args.push_back(hash.hash);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(void*)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue((void*)args[1]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            token.args.push_back(hash.hash);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValuePointer:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue((void*)args[1]);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
         
-        token.args.push_back(args[1]);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(float)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        if (var)
-            *var = L2CValue((float)fargs[0]);
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            token.args.push_back(args[1]);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValueFloat:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            if (var)
+                *var = L2CValue((float)fargs[0]);
+            else
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
         
-        token.fargs.push_back(fargs[0]);
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::L2CValue(lib::L2CValue const&)")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        L2CValue* var2 = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
-
-        if (var && var2)
+            token.fargs.push_back(fargs[0]);
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
+        }
+        case ImportHandler_ValueCopy:
         {
-            *var = L2CValue(var2);
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            L2CValue* var2 = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
 
-            token.args.push_back(args[1]);
-            token.args.push_back(var2->type);
+            if (var && var2)
+            {
+                *var = L2CValue(var2);
+
+                token.args.push_back(args[1]);
+                token.args.push_back(var2->type);
         
-            if (var2->type == L2C_number)
-                token.fargs.push_back(var2->as_number());
+                if (var2->type == L2C_number)
+                    token.fargs.push_back(var2->as_number());
+                else
+                    token.args.push_back(var2->raw);
+            }
             else
-                token.args.push_back(var2->raw);
-        }
-        else
-            printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], args[1], origin);
+                printf_error("Instance Id %u: Bad L2CValue init, %" PRIx64 ", %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], args[1], origin);
         
 
-    }
-    else if (name == "lib::L2CValue::as_number() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-
-        if (var)
-        {
-            fargs[0] = var->as_number();
-            token.fargs.push_back(var->as_number());
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_bool() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-
-        if (var)
+        case ImportHandler_AsNumber:
         {
-            args[0] = var->as_bool();
-            token.args.push_back(var->as_bool());
-        }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_integer() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
 
-        if (var)
-        {
-            token.args.push_back(var->as_integer());
-            if (var->unk == 0xBABE)
-                token.arg_is_const_value.push_back(token.args.size()-1);
-            args[0] = var->as_integer();
+            if (var)
+            {
+                fargs[0] = var->as_number();
+                token.fargs.push_back(var->as_number());
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_pointer() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-
-        if (var)
+        case ImportHandler_AsBool:
         {
-            args[0] = var->raw;
-            token.args.push_back(var->raw);
-        }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_table() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
 
-        if (var)
-        {
-            args[0] = var->raw;
-            token.args.push_back(var->raw);
+            if (var)
+            {
+                args[0] = var->as_bool();
+                token.args.push_back(var->as_bool());
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_inner_function() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+        case ImportHandler_AsInteger:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
 
-        if (var)
+            if (var)
+            {
+                token.args.push_back(var->as_integer());
+                if (var->unk == 0xBABE)
+                    token.arg_is_const_value.push_back(token.args.size()-1);
+                args[0] = var->as_integer();
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
+        }
+        case ImportHandler_AsPointer:
         {
-            args[0] = var->raw;
-            token.args.push_back(var->raw);
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+
+            if (var)
+            {
+                args[0] = var->raw;
+                token.args.push_back(var->raw);
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_hash() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+        case ImportHandler_AsTable:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
 
-        if (var)
+            if (var)
+            {
+                args[0] = var->raw;
+                token.args.push_back(var->raw);
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
+        }
+        case ImportHandler_AsInnerFunction:
         {
-            args[0] = var->as_hash();
-            token.args.push_back(var->as_hash());
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+
+            if (var)
+            {
+                args[0] = var->raw;
+                token.args.push_back(var->raw);
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::as_string() const")
-    {
-        L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+        case ImportHandler_AsHash:
+        {
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
 
-        if (var)
+            if (var)
+            {
+                args[0] = var->as_hash();
+                token.args.push_back(var->as_hash());
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
+        }
+        case ImportHandler_AsString:
         {
-            args[0] = var->raw;
-            token.args.push_back(var->raw);
+            L2CValue* var = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+
+            if (var)
+            {
+                args[0] = var->raw;
+                token.args.push_back(var->raw);
+            }
+            else
+                printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
+            break;
         }
-        else
-            printf_error("Instance Id %u: Bad L2CValue access, %" PRIx64 ", %" PRIx64 "\n", inst->get_id(), args[0], origin);
-    }
-    else if (name == "lib::L2CValue::~L2CValue()")
-    {
-        //inst->lua_active_vars[args[0]] = nullptr;
-        //add_token = false;
-        //purge_markers(token.pc);
-    }
-    else if (name == "lib::L2CValue::operator[](phx::Hash40) const")
-    {
-        if (!hash_cheat[args[1]])
+        case ImportHandler_ValueDestruct:
         {
-            hash_cheat[args[1]] = inst->heap_alloc(0x10);
+            //inst->lua_active_vars[args[0]] = nullptr;
+            //add_token = false;
+            //purge_markers(token.pc);
+            break;
         }
+        case ImportHandler_IndexHash:
+        {
+            std::lock_guard<std::mutex> globals_lock(import_globals_lock);
+            if (!hash_cheat[args[1]])
+            {
+                hash_cheat[args[1]] = inst->heap_alloc(0x10);
+            }
 
-        uint64_t l2cval = hash_cheat[args[1]];
-        hash_cheat_rev[l2cval] = args[1];
+            uint64_t l2cval = hash_cheat[args[1]];
+            hash_cheat_rev[l2cval] = args[1];
 
-        printf_verbose("Hash cheating!! %llx\n", l2cval);
+            printf_verbose("Hash cheating!! %llx\n", l2cval);
         
-        args[0] = l2cval;
+            args[0] = l2cval;
         
-        token.args.push_back(args[1]);
-    }
-    else if (name == "lib::L2CValue::operator[](int) const")
-    {
-        //TODO impl
-        //token.args.push_back(args[0]);
-        token.args.push_back(args[1]);
-    }
-    else if (name == "lib::L2CValue::operator=(lib::L2CValue const&)")
-    {
-        L2CValue* out = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-        L2CValue* in = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
-        
-        if (in && out)
-        {
-            //TODO operator= destruction
-            *out = *in;
-            
-            if (hash_cheat_rev[args[0]])
-            {
-                printf_verbose("Hash cheating! %llx => %llx\n", hash_cheat_rev[args[0]], in->raw);
-                function_hashes[std::pair<uint64_t, uint64_t>(hash_cheat_ptr, hash_cheat_rev[args[0]])] = in->raw;
-            }
+            token.args.push_back(args[1]);
+            break;
         }
-        else
+        case ImportHandler_IndexInt:
         {
-            printf_error("Instance Id %u: Bad L2CValue assignment @ " PRIx64 "!\n", inst->get_id(), origin);
+            //TODO impl
+            //token.args.push_back(args[0]);
+            token.args.push_back(args[1]);
+            break;
         }
-    }
-    else if (name == "lib::L2CValue::operator bool() const"
-             || name == "lib::L2CValue::operator==(lib::L2CValue const&) const"
-             || name == "lib::L2CValue::operator<=(lib::L2CValue const&) const"
-             || name == "lib::L2CValue::operator<(lib::L2CValue const&) const")
-    {
-        //TODO basic emu comparisons
-        if (inst->is_basic_emu())
+        case ImportHandler_Assign:
         {
-            L2CValue* in = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
-            if (in)
-                args[0] = in->as_bool();
+            L2CValue* out = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+            L2CValue* in = (L2CValue*)inst->uc_ptr_to_real_ptr(args[1]);
+        
+            if (in && out)
+            {
+                //TODO operator= destruction
+                *out = *in;
+            
+                std::lock_guard<std::mutex> globals_lock(import_globals_lock);
+                if (hash_cheat_rev[args[0]])
+                {
+                    printf_verbose("Hash cheating! %llx => %llx\n", hash_cheat_rev[args[0]], in->raw);
+                    function_hashes[std::pair<uint64_t, uint64_t>(hash_cheat_ptr, hash_cheat_rev[args[0]])] = in->raw;
+                }
+            }
             else
-                args[0] = 0;
+            {
+                printf_error("Instance Id %u: Bad L2CValue assignment @ " PRIx64 "!\n", inst->get_id(), origin);
+            }
+            break;
         }
-        else
+        case ImportHandler_Compare:
         {
-            if (add_token)
-                cluster->add_subreplace_token(inst, origin_block, token);
-            add_token = false;
+            //TODO basic emu comparisons
+            if (inst->is_basic_emu())
+            {
+                L2CValue* in = (L2CValue*)inst->uc_ptr_to_real_ptr(args[0]);
+                if (in)
+                    args[0] = in->as_bool();
+                else
+                    args[0] = 0;
+            }
+            else
+            {
+                if (add_token)
+                {
+                    std::lock_guard<std::recursive_mutex> token_lock(cluster->get_state_mutex());
+                    cluster->add_subreplace_token(inst, origin_block, token);
+                }
+                add_token = false;
 
-            inst->regs_cur.x0 = 1;
-            inst->regs_flush();
-            inst->fork_inst();
+                // Forking can wait on memory, which siblings can only free
+                // if the state lock isn't held meanwhile
+                inst->regs_cur.x0 = 1;
+                inst->regs_flush();
+                inst->fork_inst();
 
-            inst->regs_cur.x0 = 0;
-            args[0] = 0;
+                inst->regs_cur.x0 = 0;
+                args[0] = 0;
+            }
+            break;
         }
+
+        case ImportHandler_Record:
+        default:
+            break;
     }
 
     inst->regs_cur.x0 = args[0];
@@ -851,131 +926,158 @@ void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager*
     inst->regs_cur.s8 = fargs[8];
     inst->regs_flush();
     
+    lock.lock();
     if (add_token)
         cluster->add_subreplace_token(inst, origin_block, token);
 
     inst->pop_block();
 }
 
-void hook_memrw(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, ClusterManager* cluster)
+// The hash tracing hooks hold unhash_lock for their whole run, so these look
+// the maps up directly
+static bool has_unhash_part(uint32_t crc)
+{
+    auto iter = unhash_parts.find(crc);
+    return iter != unhash_parts.end() && iter->second != "";
+}
+
+static bool has_unhash(uint64_t hash)
+{
+    auto iter = unhash.find(hash);
+    return iter != unhash.end() && iter->second != "";
+}
+
+// Hashes built on the stack get read back 4 bytes at a time, sometimes in two parts
+void hook_stack_read(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine)
+{
+    if (size != 4) return;
+
+    EmuInstance* inst = engine->get_running_inst();
+    uint32_t hash_maybe = *(uint32_t*)inst->uc_ptr_to_real_ptr(addr);
+    
+    if (hash_maybe < 0x100)
+        inst->sp_part1 = hash_maybe;
+    else
+        inst->sp_part2 = hash_maybe << 8;
+    
+    std::lock_guard<std::mutex> lock(unhash_lock);
+
+    if (has_unhash_part(hash_maybe))
+    {
+        inst->last_crcs.insert(hash_maybe);
+        //printf("sp hash %08x %s\n", hash_maybe, unhash_parts[hash_maybe].c_str());
+    }
+    
+    hash_maybe = inst->sp_part1 | inst->sp_part2;
+    if (has_unhash_part(hash_maybe))
+    {
+        inst->last_crcs.insert(hash_maybe);
+        //printf("sp hash %08x %s\n", hash_maybe, unhash_parts[hash_maybe].c_str());
+    }
+}
+
+// Every CRC32 table lookup is one more byte of whatever string is being hashed
+void hook_crc_read(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine)
 {
-    EmuInstance* inst = cluster->get_running_inst();
+    EmuInstance* inst = engine->get_running_inst();
     uint32_t cur_crc, finding;
     uint8_t crcidx, crcbyte;
-    switch(type) 
+    
+    std::lock_guard<std::mutex> lock(unhash_lock);
+
+    crcidx = (addr - engine->get_crc_table()) / 4;
+    //uc_print_regs(uc);
+
+    //printf("idx %x accessed\n", crcidx);
+
+    std::set<uint32_t> potential_32_8s;
+    std::set<uint8_t> potential_8_0s;
+    std::set<uint32_t> potential_hash;
+    for (int i = UC_ARM64_REG_X0; i <= UC_ARM64_REG_X28; i++)
     {
-        default: break;
-        case UC_MEM_READ:
-            value = *(uint64_t*)(inst->uc_ptr_to_real_ptr(addr));
-            printf_verbose("Instance Id %u: Memory is being READ at 0x%" PRIx64 ", data size = %u, data value = 0x%" PRIx64 "\n", inst->get_id(), addr, size, value);
-            
-            if (size == 4 && addr >= STACK && addr <= STACK_END)
+        uint64_t reg;
+        uc_reg_read(uc, i, &reg);
+
+        //if (reg >> 32 == 0)
+        {
+            uint8_t reg_inv = reg ^ 0xFF;
+            if (has_unhash_part((uint32_t)reg))
             {
-                uint32_t hash_maybe = *(uint32_t*)inst->uc_ptr_to_real_ptr(addr);
-                
-                if (hash_maybe < 0x100)
-                    sp_part1 = hash_maybe;
-                else
-                    sp_part2 = hash_maybe << 8;
+                potential_hash.insert((uint32_t)reg);
+                //printf("CRC32? %08x %s\n", (uint32_t)reg, unhash_parts[reg].c_str());
+            }
+            else if (has_unhash(reg))
+            {
+                uint32_t inv = (uint32_t)(reg ^ ~0);
+                potential_hash.insert(inv);
+                //printf("CRC32? %08x %s\n", inv, unhash_parts[inv].c_str());
+            }
 
-                if (unhash_parts[hash_maybe] != "")
-                {
-                    last_crcs.insert(hash_maybe);
-                    //printf("sp hash %08x %s\n", hash_maybe, unhash_parts[hash_maybe].c_str());
-                }
-                
-                hash_maybe = sp_part1 | sp_part2;
-                if (unhash_parts[hash_maybe] != "")
-                {
-                    last_crcs.insert(hash_maybe);
-                    //printf("sp hash %08x %s\n", hash_maybe, unhash_parts[hash_maybe].c_str());
-                }
+            if (reg <= 0xFFFFFF)
+                potential_32_8s.insert(reg);
+            if (reg <= 0xFF)
+                potential_8_0s.insert(reg);
+        }
+    }
+
+    for (uint32_t pot_32_8 : potential_32_8s)
+    {
+        for (uint8_t pot_8_0 : potential_8_0s)
+        {
+            uint32_t hash = pot_32_8 << 8 | pot_8_0;
+            if (has_unhash_part(hash))
+            {
+                potential_hash.insert(hash);
+                //printf("CRC32? %08x %s\n", hash, unhash_parts[hash].c_str());
             }
-                 
-            if (addr >= unresolved_syms["phx::detail::CRC32Table::table_"] && addr < unresolved_syms["phx::detail::CRC32Table::table_"] + sizeof(crc32_tab))
+        }
+    }
+
+    potential_hash.insert(0xFFFFFFFF);
+
+    for (uint32_t hash : inst->last_crcs)
+        potential_hash.insert(hash);
+
+    inst->last_crcs.clear();
+    for (uint32_t pot_last_crc : potential_hash)
+    {
+        uint32_t cur_crc = crc32_tab[crcidx] ^ (pot_last_crc >> 8);
+        finding = cur_crc ^ (pot_last_crc >> 8);
+        for (int i = 0; i < 0x100; i++)
+        {
+            if (crc32_tab[i] == finding)
             {
-                crcidx = (addr - unresolved_syms["phx::detail::CRC32Table::table_"]) / 4;
-                //uc_print_regs(uc);
-                
-                //printf("idx %x accessed\n", crcidx);
-                
-                std::set<uint32_t> potential_32_8s;
-                std::set<uint8_t> potential_8_0s;
-                std::set<uint32_t> potential_hash;
-                for (int i = UC_ARM64_REG_X0; i <= UC_ARM64_REG_X28; i++)
-                {
-                    uint64_t reg;
-                    uc_reg_read(uc, i, &reg);
-                    
-                    //if (reg >> 32 == 0)
-                    {
-                        uint8_t reg_inv = reg ^ 0xFF;
-                        if (unhash_parts[(uint32_t)reg] != "")
-                        {
-                            potential_hash.insert((uint32_t)reg);
-                            //printf("CRC32? %08x %s\n", (uint32_t)reg, unhash_parts[reg].c_str());
-                        }
-                        else if (unhash[reg] != "")
-                        {
-                            uint32_t inv = (uint32_t)(reg ^ ~0);
-                            potential_hash.insert(inv);
-                            //printf("CRC32? %08x %s\n", inv, unhash_parts[inv].c_str());
-                        }
-                        
-                        if (reg <= 0xFFFFFF)
-                            potential_32_8s.insert(reg);
-                        if (reg <= 0xFF)
-                            potential_8_0s.insert(reg);
-                    }
-                }
-                
-                for (uint32_t pot_32_8 : potential_32_8s)
-                {
-                    for (uint8_t pot_8_0 : potential_8_0s)
-                    {
-                        uint32_t hash = pot_32_8 << 8 | pot_8_0;
-                        if (unhash_parts[hash] != "")
-                        {
-                            potential_hash.insert(hash);
-                            //printf("CRC32? %08x %s\n", hash, unhash_parts[hash].c_str());
-                        }
-                    }
-                }
-                
-                potential_hash.insert(0xFFFFFFFF);
-                
-                for (uint32_t hash : last_crcs)
-                    potential_hash.insert(hash);
-                
-                last_crcs.clear();
-                for (uint32_t pot_last_crc : potential_hash)
+                crcbyte = i ^ (uint8_t)pot_last_crc;
+                if ((crcbyte >= 'a' && crcbyte <= 'z') || (crcbyte >= '0' && crcbyte <= '9') || crcbyte == '_')
                 {
-                    uint32_t cur_crc = crc32_tab[crcidx] ^ (pot_last_crc >> 8);
-                    finding = cur_crc ^ (pot_last_crc >> 8);
-                    for (int i = 0; i < 0x100; i++)
+                    if (has_unhash_part(pot_last_crc) || pot_last_crc == 0xFFFFFFFF)
                     {
-                        if (crc32_tab[i] == finding)
-                        {
-                            crcbyte = i ^ (uint8_t)pot_last_crc;
-                            if ((crcbyte >= 'a' && crcbyte <= 'z') || (crcbyte >= '0' && crcbyte <= '9') || crcbyte == '_')
-                            {
-                                if (unhash_parts[pot_last_crc] != "" || pot_last_crc == 0xFFFFFFFF)
-                                {
-                                    std::string cur_str = unhash_parts[pot_last_crc] + (char)crcbyte;
-                                    unhash_parts[cur_crc] = cur_str;
-                                    unhash[(uint32_t)(cur_crc ^ ~0) | cur_str.length() << 32] = cur_str;
-                                }
-
-                                //printf("last %x cur %x hashed %c %s\n", pot_last_crc, cur_crc, crcbyte, unhash_parts[cur_crc].c_str());
-                                
-                                last_crcs.insert(cur_crc);
-                            }
-                        }
+                        auto last_part = unhash_parts.find(pot_last_crc);
+                        std::string cur_str = (last_part != unhash_parts.end() ? last_part->second : "") + (char)crcbyte;
+                        unhash_parts[cur_crc] = cur_str;
+                        unhash[(uint32_t)(cur_crc ^ ~0) | cur_str.length() << 32] = cur_str;
                     }
+
+                    //printf("last %x cur %x hashed %c %s\n", pot_last_crc, cur_crc, crcbyte, unhash_parts[cur_crc].c_str());
+
+                    inst->last_crcs.insert(cur_crc);
                 }
-                
-                //printf("CRC32 %08x %c (%x)\n", last_crc, crcidx, crcidx);
             }
+        }
+    }
+
+    //printf("CRC32 %08x %c (%x)\n", last_crc, crcidx, crcidx);
+}
+
+void hook_memrw(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine)
+{
+    EmuInstance* inst = engine->get_running_inst();
+    switch(type) 
+    {
+        default: break;
+        case UC_MEM_READ:
+            value = *(uint64_t*)(inst->uc_ptr_to_real_ptr(addr));
+            printf_verbose("Instance Id %u: Memory is being READ at 0x%" PRIx64 ", data size = %u, data value = 0x%" PRIx64 "\n", inst->get_id(), addr, size, value);
             break;
         case UC_MEM_WRITE:
             if (addr >= IMPORTS && addr < IMPORTS_END)
@@ -987,9 +1089,10 @@ void hook_memrw(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_
 }
 
 // callback for tracing memory access (READ or WRITE)
-bool hook_mem_invalid(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, ClusterManager* cluster)
+bool hook_mem_invalid(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, EmuEngine* engine)
 {
-    EmuInstance* inst = cluster->get_running_inst();
+    EmuInstance* inst = engine->get_running_inst();
+    engine->regs_stale();
     inst->regs_invalidate();
     switch(type) {
         default:
@@ -2,31 +2,85 @@
 #define UC_IMPL_H
 
 #include <stdint.h>
+#include <map>
+#include <string>
 #include "unicorn/include/unicorn/unicorn.h"
 #include <stdint.h>
 
-class ClusterManager;
+class EmuEngine;
 
-typedef struct uc_reg_state
+// Registers touched by every import and branch check come first
+typedef struct alignas(64) uc_reg_state
 {
+    uint64_t pc, lr, sp;
     uint64_t x0, x1, x2, x3, x4, x5 ,x6 ,x7, x8;
-    uint64_t x9, x10, x11, x12, x13, x14, x15, x16;
-    uint64_t x17, x18, x19, x20, x21, x22, x23, x24;
-    uint64_t x25, x26, x27, x28, fp, lr, sp, pc, nzcv;
-    uint32_t cpacr_el1;
-    
     double s0, s1, s2, s3, s4, s5 ,s6 ,s7, s8;
+    
     double s9, s10, s11, s12, s13, s14, s15, s16;
     double s17, s18, s19, s20, s21, s22, s23, s24;
     double s25, s26, s27, s28, s29, s30, s31;
+    uint64_t x9, x10, x11, x12, x13, x14, x15, x16;
+    uint64_t x17, x18, x19, x20, x21, x22, x23, x24;
+    uint64_t x25, x26, x27, x28, fp, nzcv;
+    uint32_t cpacr_el1;
 } uc_reg_state;
 
+// What hook_import does for an import, anything not listed just gets its token recorded
+enum ImportHandler
+{
+    ImportHandler_Record = 0,
+    ImportHandler_OperatorNew,
+    ImportHandler_SetFunctionHash,
+    ImportHandler_SetStatusFunc,
+    ImportHandler_VariadicGetFormat,
+    ImportHandler_ClearLuaStack,
+    ImportHandler_IsExcute,
+    ImportHandler_Frame,
+    ImportHandler_PopLuaStack,
+    ImportHandler_PushLuaStack,
+    ImportHandler_ValueInt,
+    ImportHandler_ValueLong,
+    ImportHandler_ValueUnsigned,
+    ImportHandler_ValueBool,
+    ImportHandler_ValueHash,
+    ImportHandler_ValuePointer,
+    ImportHandler_ValueFloat,
+    ImportHandler_ValueCopy,
+    ImportHandler_AsNumber,
+    ImportHandler_AsBool,
+    ImportHandler_AsInteger,
+    ImportHandler_AsPointer,
+    ImportHandler_AsTable,
+    ImportHandler_AsInnerFunction,
+    ImportHandler_AsHash,
+    ImportHandler_AsString,
+    ImportHandler_ValueDestruct,
+    ImportHandler_IndexHash,
+    ImportHandler_IndexInt,
+    ImportHandler_Assign,
+    ImportHandler_Compare,
+};
+
+struct ImportEntry
+{
+    uint32_t sym;
+    ImportHandler handler;
+};
+
+extern std::map<uint64_t, uint64_t> hash_cheat;
+extern std::map<uint64_t, uint64_t> hash_cheat_rev;
+extern uint64_t hash_cheat_ptr;
+
+extern void import_bind(uint64_t addr, const std::string& name);
 extern void uc_read_reg_state(uc_engine *uc, struct uc_reg_state *regs);
 extern void uc_write_reg_state(uc_engine *uc, struct uc_reg_state *regs);
+extern void uc_sync_reg_state(uc_engine *uc, struct uc_reg_state *regs, struct uc_reg_state *known);
 extern void uc_print_regs(uc_engine *uc);
-extern void hook_code(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager* cluster);
-extern void hook_import(uc_engine *uc, uint64_t address, uint32_t size, ClusterManager* cluster);
-extern void hook_memrw(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, ClusterManager* cluster);
-extern bool hook_mem_invalid(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, ClusterManager* cluster);
+extern void hook_code(uc_engine *uc, uint64_t address, uint32_t size, EmuEngine* engine);
+extern void hook_import(uc_engine *uc, uint64_t address, uint32_t size, EmuEngine* engine);
+extern void hook_stack_read(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine);
+extern void hook_crc_read(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine);
+extern void hook_memrw(uc_engine *uc, uc_mem_type type, uint64_t addr, int size, int64_t value, EmuEngine* engine);
+extern bool hook_mem_invalid(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, EmuEngine* engine);
 
 #endif // UC_IMPL_H
@@ -2,71 +2,141 @@
 
 #include "uc_impl.h"
 #include "clustermanager.h"
+#include "forkpool.h"
+#include "slabpool.h"
 
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <chrono>
 
 std::atomic<int> uc_insts_active;
 std::atomic<uint64_t> uc_memory_use = 0;
 
-void uc_res_wait(int id)
+static std::mutex uc_res_lock;
+static std::condition_variable uc_res_cond;
+
+// Cached slabs count too, but can be dropped to make room
+static bool uc_res_fits(uint64_t size)
 {
-    while (uc_memory_use > MAX_UC_MEM)
+    if (uc_memory_use + slab_cached() + size <= MAX_UC_MEM) return true;
+
+    slab_trim();
+    return uc_memory_use + slab_cached() + size <= MAX_UC_MEM;
+}
+
+// Reserved under the lock, so waiters woken together can't all take the
+// same room
+void uc_res_wait(int id, uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(uc_res_lock);
+    if (!uc_res_fits(size))
     {
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(1s);
+        printf_warn("Instance Id %i: Waiting for memory use to lower (%" PRIx64 " + %" PRIx64 ", %" PRIx64 " cached, %u; MAX %" PRIx64 ")...\n", id, uc_memory_use.load(), size, slab_cached(), uc_insts_active.load(), MAX_UC_MEM);
+        uc_res_cond.wait(lock, [size] { return uc_res_fits(size); });
+    }
 
-        printf_warn("Instance Id %u: Waiting for memory use to lower (%" PRIx64 ", %u; MAX %" PRIx64 ")...\n", id, uc_memory_use.load(), uc_insts_active.load(), MAX_UC_MEM);
+    uc_memory_use += size;
+}
+
+// For admitting work that reserves its memory later on
+void uc_res_wait_room(uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(uc_res_lock);
+    uc_res_cond.wait(lock, [size] { return uc_res_fits(size); });
+}
+
+// Taken under the lock so a waiter can't miss the wakeup between its check and its wait
+void uc_res_release(uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(uc_res_lock);
+        uc_memory_use -= size;
     }
+    uc_res_cond.notify_all();
+}
+
+void uc_res_notify()
+{
+    {
+        std::lock_guard<std::mutex> lock(uc_res_lock);
+    }
+    uc_res_cond.notify_all();
 }
 
 EmuInstance::EmuInstance(ClusterManager* parent_cluster)
 {
     cluster = parent_cluster;
+    engine = cluster->get_engine();
     instance_id = cluster->create_id();
     
-    uc_res_wait(get_id());
+    mem_size = STACK_SIZE + HEAP_SIZE;
+    uc_res_wait(get_id(), mem_size);
     
     // map and read memory
     
     nro = cluster->get_nro_mem();
-    stack = malloc(STACK_SIZE);
-    heap = malloc(HEAP_SIZE);
+    stack = slab_take(STACK_SIZE);
+    heap = slab_take(HEAP_SIZE);
+    heap_owned = true;
     imports = cluster->get_import_mem();
     
     parent = nullptr;
     uc_term = false;
+    update_fork_hierarchy();
 
     uc_insts_active++;
-    uc_memory_use += STACK_SIZE + HEAP_SIZE;
 }
 
 EmuInstance::EmuInstance(ClusterManager* parent_cluster, EmuInstance* to_clone, EmuInstance* parent)
 {
     cluster = parent_cluster;
+    engine = parent ? parent->engine : cluster->get_engine();
     instance_id = cluster->create_id();
+    heap_owned = parent == nullptr && !cluster->get_heap_fixed();
     
-    uc_res_wait(get_id());
+    mem_size = STACK_SIZE + (heap_owned ? HEAP_SIZE : 0);
+    uc_res_wait(get_id(), mem_size);
 
     // map and read memory
     nro = cluster->get_nro_mem();
-    stack = malloc(STACK_SIZE);
-    if (parent == nullptr && !cluster->get_heap_fixed())
-        heap = malloc(HEAP_SIZE);
+    stack = slab_take(STACK_SIZE);
+    if (heap_owned)
+        heap = slab_take(HEAP_SIZE);
     else
         heap = to_clone->heap;
     imports = cluster->get_import_mem();
     
     this->parent = parent;
     uc_term = false;
+    update_fork_hierarchy();
+
+    // Only the pages the guest has actually used get copied. Stack pages below
+    // SP are dead, heap pages past heap_size were never handed out, and forks
+    // share their parent's heap and the cluster's imports outright.
+    uint64_t stack_used = STACK;
+    if (to_clone->get_sp() > STACK && to_clone->get_sp() <= STACK_END)
+        stack_used = GUEST_PAGE_ALIGN(to_clone->get_sp());
+    memcpy(uc_ptr_to_real_ptr(stack_used), to_clone->uc_ptr_to_real_ptr(stack_used), STACK_END - stack_used);
+
+    if (heap != to_clone->heap)
+    {
+        uint64_t heap_used = GUEST_PAGE_ALIGN(to_clone->heap_size + GUEST_PAGE_SIZE - 1);
+        if (heap_used > HEAP_SIZE)
+            heap_used = HEAP_SIZE;
+
+        // Pooled slabs aren't zeroed, clear what the copy doesn't cover
+        memcpy(heap, to_clone->heap, heap_used);
+        memset((char*)heap + heap_used, 0, HEAP_SIZE - heap_used);
+    }
 
-    memcpy(stack, to_clone->stack, STACK_SIZE);
-    memcpy(heap, to_clone->heap, HEAP_SIZE);
-    memcpy(imports, to_clone->imports, IMPORTS_SIZE);
     heap_size = to_clone->heap_size;
     lua_stack = to_clone->lua_stack;
     lua_active_vars = to_clone->lua_active_vars;
+    sp_part1 = to_clone->sp_part1;
+    sp_part2 = to_clone->sp_part2;
+    last_crcs = to_clone->last_crcs;
     block_stack = to_clone->block_stack;
     slow = to_clone->slow;
     reg_history = to_clone->reg_history;
@@ -75,7 +145,6 @@ EmuInstance::EmuInstance(ClusterManager* parent_cluster, EmuInstance* to_clone,
     fork_addr = get_pc() - 4;
 
     uc_insts_active++;
-    uc_memory_use += STACK_SIZE + HEAP_SIZE;
 }
 
 EmuInstance::~EmuInstance()
@@ -86,17 +155,21 @@ EmuInstance::~EmuInstance()
     }
     forks.clear();
     
-    if (!has_parent() && !cluster->get_heap_fixed())
-        free(heap);
-    free(stack);
+    if (engine)
+        engine->unmap_inst_mem(heap_owned ? heap : nullptr, stack);
+
+    uc_insts_active--;
+    uc_res_release(mem_size);
+
+    // Released first so the slab pool sees the budget without this instance
+    if (heap_owned)
+        slab_give(heap, HEAP_SIZE);
+    slab_give(stack, STACK_SIZE);
     
     nro = nullptr;
     stack = nullptr;
     heap = nullptr;
     imports = nullptr;
-    uc_insts_active--;
-    
-    uc_memory_use -= STACK_SIZE + HEAP_SIZE;
 }
 
 int EmuInstance::cluster_id()
@@ -106,46 +179,249 @@ int EmuInstance::cluster_id()
 
 void EmuInstance::forks_complete()
 {
+    ForkPool pool(cluster, fork_threads > 1 ? fork_threads : 1, fork_breadth_first);
+    pool.run(this);
+}
+
+std::vector<EmuInstance*> EmuInstance::take_forks()
+{
+    std::vector<EmuInstance*> out;
     for (auto fork : forks)
     {
-        if (!fork) continue;
-        if (!fork->is_term() && !fork->get_start_addr())
-            printf_warn("Instance Id %u: Fork Instance Id %u never finished diverge tests!\n", get_id(), fork->get_id());
-    
-        uc_err err = UC_ERR_OK;
-        while (fork && !err && !fork->is_term())
-        {
-            regs_invalidate();
-            err = fork->uc_run_slice();
-            regs_flush();
-        }
-        
-        fork->forks_complete();
-        
-        if (fork) delete fork;
+        if (fork) out.push_back(fork);
     }
     forks.clear();
+    
+    return out;
+}
+
+void EmuInstance::move_to_engine(EmuEngine* to)
+{
+    if (engine)
+        engine->unmap_inst_mem(heap, stack);
+
+    engine = to;
+}
+
+// Forks normally share their parent's heap, that only holds up while they
+// run one at a time on the same thread
+void EmuInstance::own_heap()
+{
+    if (heap_owned) return;
+    
+    // Same budget as any other instance's memory, charged before it's taken
+    uc_res_wait(get_id(), HEAP_SIZE);
+    mem_size += HEAP_SIZE;
+
+    void* shared = heap;
+    uint64_t heap_used = GUEST_PAGE_ALIGN(heap_size + GUEST_PAGE_SIZE - 1);
+    if (heap_used > HEAP_SIZE)
+        heap_used = HEAP_SIZE;
+
+    heap = slab_take(HEAP_SIZE);
+    memcpy(heap, shared, heap_used);
+    memset((char*)heap + heap_used, 0, HEAP_SIZE - heap_used);
+    heap_owned = true;
+    
+    for (auto fork : forks)
+    {
+        if (fork && fork->heap == shared)
+            fork->heap = heap;
+    }
 }
 
 void EmuInstance::fork_inst()
 {
     if (is_term() || watching_fork) return;
 
+    // Cloning can wait on memory, so only the block pop takes the state lock
     regs_invalidate();
     EmuInstance* fork = new EmuInstance(cluster, this, this);
-    fork->pop_block(true);
+    {
+        std::lock_guard<std::recursive_mutex> lock(cluster->get_state_mutex());
+        fork->pop_block(true);
+    }
     regs_flush();
 
     printf_verbose("Instance Id %u forked to Instance Id %u, start=%llx, end=%llx\n", get_id(), fork->get_id(), fork->get_start_addr(), fork->get_end_addr());
     forks.push_back(fork);
     
     watching_fork = fork->get_id();
+    
+    // The two sides only differ by the comparison result in x0. When the code
+    // after the import branches straight on it, each side splits off as it runs
+    // that branch and the fork never has to be replayed against this instance.
+    uint64_t branch_pc, if_false, if_true;
+    if (compare_branch(get_lr(), &branch_pc, &if_false, &if_true))
+    {
+        printf_verbose("Instance Id %u: Instance Id %u will diverge at %" PRIx64 " to %" PRIx64 ", we go to %" PRIx64 "\n", get_id(), fork->get_id(), branch_pc, if_true, if_false);
+
+        for (EmuInstance* side : {this, fork})
+        {
+            side->div_branch = branch_pc;
+            side->div_false = if_false;
+            side->div_true = if_true;
+            side->div_fork_addr = fork->get_fork_addr();
+            side->div_true_side = side == fork;
+        }
+    }
+}
+
+// Scans the straight-line code a comparison import returns to for the branch
+// on its result. Only the common shapes are understood: cbz/cbnz, tbz/tbnz on
+// bit 0, and b.eq/b.ne right after tst #1 or cmp #0, with the result moved
+// around by mov and and #1 on the way. Registers anything else might write
+// stop counting as the result, and anything unclear falls back to replaying.
+bool EmuInstance::compare_branch(uint64_t pc, uint64_t* branch_pc, uint64_t* if_false, uint64_t* if_true)
+{
+    uint32_t result_regs = BIT(0);
+    bool flags_from_result = false;
+
+    for (int i = 0; i < COMPARE_BRANCH_SCAN_LIMIT; i++, pc += 4)
+    {
+        if (pc < NRO || pc >= NRO + NRO_SIZE) return false;
+
+        uint32_t instr = *(uint32_t*)uc_ptr_to_real_ptr(pc);
+        uint32_t rd = instr & 0x1F;
+        uint32_t rn = (instr >> 5) & 0x1F;
+        uint32_t rm = (instr >> 16) & 0x1F;
+        bool is_result = false;
+        bool taken_if_false = false;
+        int64_t offset = 0;
+
+        if ((instr & 0x7E000000) == 0x34000000) // cbz/cbnz
+        {
+            is_result = result_regs & BIT(rd);
+            taken_if_false = !(instr & BIT(24));
+            offset = (int64_t)((int32_t)(instr << 8) >> 13) * 4;
+        }
+        else if ((instr & 0x7E000000) == 0x36000000) // tbz/tbnz
+        {
+            if ((instr & 0x80F80000) != 0) return false; // some bit other than 0
+            
+            is_result = result_regs & BIT(rd);
+            taken_if_false = !(instr & BIT(24));
+            offset = (int64_t)((int32_t)(instr << 13) >> 18) * 4;
+        }
+        else if ((instr & 0xFF000010) == 0x54000000) // b.cond
+        {
+            uint32_t cond = instr & 0xF;
+            if (cond > 1) return false; // not eq/ne
+            
+            is_result = flags_from_result;
+            taken_if_false = cond == 0;
+            offset = (int64_t)((int32_t)(instr << 8) >> 13) * 4;
+        }
+        else if (INSTR_IS_BLOCK_END(instr))
+        {
+            return false;
+        }
+        else
+        {
+            bool writes_result = false;
+            flags_from_result = false;
+            
+            if ((instr & 0xFFFFFC00) == 0x12000000 || (instr & 0xFFFFFC00) == 0x92400000) // and #1
+            {
+                writes_result = result_regs & BIT(rn);
+            }
+            else if ((instr & 0xFFFFFC00) == 0x72000000 || (instr & 0xFFFFFC00) == 0xF2400000 // ands #1, tst #1
+                     || (instr & 0x7FFFFC00) == 0x71000000) // subs #0, cmp #0
+            {
+                writes_result = result_regs & BIT(rn);
+                flags_from_result = writes_result;
+            }
+            else if ((instr & 0x7FE0FFE0) == 0x2A0003E0) // mov
+            {
+                writes_result = result_regs & BIT(rm);
+            }
+            else
+            {
+                // Destination, pair and writeback base fields all count as written
+                result_regs &= ~(BIT(rd) | BIT(rn) | BIT(rm) | BIT((instr >> 10) & 0x1F));
+                continue;
+            }
+
+            if (rd == 31) continue;
+            
+            if (writes_result)
+                result_regs |= BIT(rd);
+            else
+                result_regs &= ~BIT(rd);
+            continue;
+        }
+
+        if (!is_result || !offset || offset == 4) return false;
+
+        *branch_pc = pc;
+        *if_false = taken_if_false ? pc + offset : pc + 4;
+        *if_true = taken_if_false ? pc + 4 : pc + offset;
+        return true;
+    }
+
+    return false;
+}
+
+// This side's half of a comparison fork splitting, once it has ran the branch.
+// The false side records the split for both, since it runs first. Returns
+// whether this side converged straight away.
+bool EmuInstance::diverge()
+{
+    uint64_t branch_pc = div_branch;
+    div_branch = 0;
+    
+    uint64_t expected = div_true_side ? div_true : div_false;
+    if (get_pc() != expected)
+    {
+        printf_error("Instance Id %u: Expected to diverge from %" PRIx64 " to %" PRIx64 ", ended up at %" PRIx64 "\n", get_id(), branch_pc, expected, get_pc());
+    }
+    
+    if (div_true_side)
+    {
+        set_start_addr(get_pc());
+    }
+    else
+    {
+        // Branch instruction is the last instruction of that block
+        cluster->set_block_end(get_current_block(), branch_pc+4);
+
+        L2C_Token token;
+        token.pc = branch_pc;
+        token.fork_hierarchy = get_fork_hierarchy();
+        token.sym = L2C_TokenSym_DivFalse;
+        token.type = L2C_TokenType_Meta;
+        token.args.push_back(div_false);
+        token.args.push_back(div_fork_addr);
+        cluster->add_token_by_prio(get_current_block(), token);
+        
+        token.sym = L2C_TokenSym_DivTrue;
+        token.args.clear();
+        token.args.push_back(div_true);
+        token.args.push_back(div_fork_addr);
+        cluster->add_token_by_prio(get_current_block(), token);
+        
+        cluster->set_fork_origin(branch_pc);
+        watching_fork = 0;
+    }
+    
+    if (get_current_block_type() == L2C_CodeBlockType_Fork || get_current_block_type() == L2C_CodeBlockType_Goto)
+        pop_block(true);
+    push_block(L2C_CodeBlockType_Fork);
+    
+    if (cluster->convergable_block(get_current_block(), get_fork_hierarchy().vec()))
+    {
+        printf_debug("Instance Id %u: Found fork block convergence at %" PRIx64 ", outputted %u tokens\n", get_id(), get_pc(), num_outputted_tokens());
+        return true;
+    }
+    
+    return false;
 }
 
 uc_err EmuInstance::uc_run_slice()
 {
     uc_err err;
     uint64_t start_pc = 0, start_lr = 0, start_sp = 0;
+    std::unique_lock<std::recursive_mutex> lock(cluster->get_state_mutex(), std::defer_lock);
     
     regs_flush();
     start_pc = get_pc();
@@ -168,11 +444,46 @@ uc_err EmuInstance::uc_run_slice()
         return err;
     }
 
+    // Only the block and token bookkeeping below needs the state lock
+    lock.lock();
+
     bool placed_fork = false;
+    if (div_branch && reg_history.size() > 1 && reg_history[1].pc == div_branch)
+    {
+        placed_fork = true;
+        if (diverge())
+        {
+            uc_term = true;
+            return err;
+        }
+    }
+    
     for (auto fork : forks)
     {
         if (!fork) continue;
-        if (fork->get_start_addr() || fork->is_term()) continue;
+        if (fork->get_start_addr() || fork->is_term() || fork->get_div_branch()) continue;
+        
+        // Both sides run the same code up until a branch, so the fork only
+        // gets caught up and compared right after we've ran one
+        uint64_t branch_pc = reg_history.size() > 1 ? reg_history[1].pc : 0;
+        if (branch_pc < NRO || branch_pc >= NRO + NRO_SIZE) continue;
+        if (!INSTR_IS_BLOCK_END(*(uint32_t*)uc_ptr_to_real_ptr(branch_pc))) continue;
+
+        // The fork is only ours to run, catching it up doesn't need the lock
+        regs_invalidate();
+        lock.unlock();
+        fork->sync_to(branch_pc);
+        lock.lock();
+        regs_flush();
+        
+        if (fork->is_term()) continue;
+        
+        // Lost sync, it's running as a diverged fork with no split recorded
+        if (fork->get_start_addr())
+        {
+            watching_fork = 0;
+            continue;
+        }
 
         if (fork->get_pc() != get_pc())
         {
@@ -181,18 +492,18 @@ uc_err EmuInstance::uc_run_slice()
             fork->set_start_addr(fork->get_pc());
             
             // Branch instruction is the last instruction of that block
-            cluster->blocks[get_current_block()].addr_end = reg_history[1].pc+4;
+            cluster->set_block_end(get_current_block(), reg_history[1].pc+4);
 
             L2C_Token token;
             token.pc = reg_history[1].pc;
             token.fork_hierarchy = get_fork_hierarchy();
-            token.str = "DIV_FALSE";
+            token.sym = L2C_TokenSym_DivFalse;
             token.type = L2C_TokenType_Meta;
             token.args.push_back(get_pc());
             token.args.push_back(fork->get_fork_addr());
             cluster->add_token_by_prio(get_current_block(), token);
             
-            token.str = "DIV_TRUE";
+            token.sym = L2C_TokenSym_DivTrue;
             token.type = L2C_TokenType_Meta;
             token.args.clear();
             token.args.push_back(fork->get_pc());
@@ -214,14 +525,14 @@ uc_err EmuInstance::uc_run_slice()
             
             // These usually happen with loops where there's one last if block at the end of a while
             // and the DIV_FALSE path just wraps back around
-            if (cluster->convergable_block(get_current_block(), get_fork_hierarchy()))
+            if (cluster->convergable_block(get_current_block(), get_fork_hierarchy().vec()))
             {
                 printf_debug("Instance Id %u: Found fork block convergence at %" PRIx64 ", outputted %u tokens\n", get_id(), get_pc(), num_outputted_tokens());
                 uc_term = true;
                 return err;
             }
 
-            if (cluster->convergable_block(fork->get_current_block(), fork->get_fork_hierarchy()))
+            if (cluster->convergable_block(fork->get_current_block(), fork->get_fork_hierarchy().vec()))
             {
                 printf_debug("Instance Id %u: Found fork block convergence at %" PRIx64 ", outputted %u tokens\n", fork->get_id(), fork->get_pc(), fork->num_outputted_tokens());
                 fork->terminate();
@@ -230,12 +541,6 @@ uc_err EmuInstance::uc_run_slice()
             placed_fork = true;
             watching_fork = 0;
         }
-        else
-        {
-            regs_invalidate();
-            fork->uc_run_slice();
-            regs_flush();
-        }
     }
     
     if (slow && reg_history.size() > 2 
@@ -252,17 +557,17 @@ uc_err EmuInstance::uc_run_slice()
             printf_verbose("Instance Id %u: Goto branch detected PC @ %" PRIx64 ", prev %" PRIx64 " lr %" PRIx64 "\n", get_id(), reg_history[0].pc, reg_history[1].pc, reg_history[0].lr);
             
             uint64_t goto_block = get_current_block();
-            cluster->remove_block_matching_tokens(goto_block, cluster->blocks[goto_block].addr_end, "BLOCK_MERGE");
-            cluster->remove_block_matching_tokens(goto_block, cluster->blocks[goto_block].addr_end, "SPLIT_BLOCK_MERGE");
+            cluster->remove_block_matching_tokens(goto_block, cluster->live_block(goto_block).addr_end, L2C_TokenSym_BlockMerge);
+            cluster->remove_block_matching_tokens(goto_block, cluster->live_block(goto_block).addr_end, L2C_TokenSym_SplitBlockMerge);
             
             // Last block is done
-            cluster->blocks[get_current_block()].addr_end = reg_history[1].pc+4;
+            cluster->set_block_end(get_current_block(), reg_history[1].pc+4);
 
             L2C_Token token;
 
             token.pc = reg_history[1].pc;
             token.fork_hierarchy = get_fork_hierarchy();
-            token.str = "SUB_GOTO";
+            token.sym = L2C_TokenSym_SubGoto;
             token.type = L2C_TokenType_Branch;
             token.args.push_back(reg_history[0].pc);
             cluster->add_token_by_prio(goto_block, token);
@@ -274,7 +579,7 @@ uc_err EmuInstance::uc_run_slice()
             push_block(L2C_CodeBlockType_Goto);
             push_jump(reg_history[1].pc);
             
-            if (get_start_addr() && cluster->convergable_block(reg_history[0].pc, get_fork_hierarchy()))
+            if (get_start_addr() && cluster->convergable_block(reg_history[0].pc, get_fork_hierarchy().vec()))
             {
                 printf_debug("Instance Id %u: Found goto block convergence at %" PRIx64 ", outputted %u tokens\n", get_id(), reg_history[0].pc, num_outputted_tokens());
                 uc_term = true;
@@ -284,35 +589,35 @@ uc_err EmuInstance::uc_run_slice()
     }
 
     if (slow && !placed_fork
-        && cluster->blocks[start_pc].type != L2C_CodeBlockType_Invalid
+        && cluster->live_block(start_pc).type != L2C_CodeBlockType_Invalid
         && start_pc != get_current_block()
         && get_start_addr() && !watching_fork)
     {
-        printf_verbose("Instance Id %u: Crossed a block boundary at %" PRIx64 "! current_block=%" PRIx64 " creator=%i, type=%i\n", get_id(), start_pc, get_current_block(), cluster->blocks[start_pc].creator(), cluster->blocks[start_pc].type);
+        printf_verbose("Instance Id %u: Crossed a block boundary at %" PRIx64 "! current_block=%" PRIx64 " creator=%i, type=%i\n", get_id(), start_pc, get_current_block(), cluster->live_block(start_pc).creator(), cluster->live_block(start_pc).type);
 
         // Last block is done
-        cluster->blocks[get_current_block()].addr_end = start_pc;
+        cluster->set_block_end(get_current_block(), start_pc);
 
         L2C_Token token;
         //TODO: move this back into the range?
-        token.pc = cluster->blocks[get_current_block()].addr_end;
+        token.pc = cluster->live_block(get_current_block()).addr_end;
         token.fork_hierarchy = get_fork_hierarchy();
-        token.str = "BLOCK_MERGE";
+        token.sym = L2C_TokenSym_BlockMerge;
         token.type = L2C_TokenType_Meta;
         token.args.push_back(start_pc);
         if (!cluster->is_fork_origin(reg_history[1].pc))
         {
             uint64_t block = get_current_block();
-            cluster->remove_block_matching_tokens(block, cluster->blocks[block].addr_end, "SPLIT_BLOCK_MERGE");
+            cluster->remove_block_matching_tokens(block, cluster->live_block(block).addr_end, L2C_TokenSym_SplitBlockMerge);
             cluster->add_token_by_prio(get_current_block(), token);
         }
 
         if (get_current_block_type() == L2C_CodeBlockType_Fork || get_current_block_type() == L2C_CodeBlockType_Goto)
             pop_block(true);
 
-        if (get_start_addr() && cluster->convergable_block(start_pc, get_fork_hierarchy()))
+        if (get_start_addr() && cluster->convergable_block(start_pc, get_fork_hierarchy().vec()))
         {
-            //printf_debug("%s\n", cluster->blocks[start_pc].fork_hierarchy_str().c_str());
+            //printf_debug("%s\n", cluster->live_block(start_pc).fork_hierarchy_str().c_str());
             printf_debug("Instance Id %u: Found block end convergence at %" PRIx64 ", outputted %u tokens\n", get_id(), start_pc, num_outputted_tokens());
             uc_term = true;
             return err;
@@ -321,43 +626,57 @@ uc_err EmuInstance::uc_run_slice()
         push_block(L2C_CodeBlockType_Fork);
     }
 
-    if (has_parent() && get_start_addr() && cluster->convergable_block(get_current_block(), get_fork_hierarchy()))
+    if (has_parent() && get_start_addr() && cluster->convergable_block(get_current_block(), get_fork_hierarchy().vec()))
     {
         printf_debug("Instance Id %u: Found block convergence at %" PRIx64 ", outputted %u tokens\n", get_id(), start_pc, num_outputted_tokens());
         uc_term = true;
         return err;
     }
 
-    // This instruction will run under this block
-    if (slow && start_pc - cluster->blocks[get_current_block()].addr_end == 4)
-        cluster->blocks[get_current_block()].addr_end = start_pc+4;
+    // Straight-line code runs as one slice, the block's terminating instruction
+    // always gets a slice to itself so the branch detection above still sees it.
+    uint64_t end_pc = start_pc + 4;
+    if (slow && slow_block_slices)
+    {
+        end_pc = slice_end(start_pc);
+        instrs = (end_pc - start_pc) / 4;
+    }
+
+    // These instructions will run under this block
+    for (uint64_t pc = start_pc; slow && pc < end_pc; pc += 4)
+    {
+        if (pc - cluster->live_block(get_current_block()).addr_end == 4)
+            cluster->set_block_end(get_current_block(), pc+4);
+    }
     
-    //printf("Instance Id %u: block %llx-%llx, pc %llx, size %llx\n", get_id(), get_current_block(), cluster->blocks[get_current_block()].addr_end, start_pc, cluster->blocks[get_current_block()].size());
+    //printf("Instance Id %u: block %llx-%llx, pc %llx, size %llx\n", get_id(), get_current_block(), cluster->live_block(get_current_block()).addr_end, start_pc, cluster->live_block(get_current_block()).size());
 
-    cluster->set_running_inst(this);
+    engine->set_running_inst(this);
     regs_flush();
-    uc_mem_map_ptr(cluster->get_uc(), HEAP, HEAP_SIZE, UC_PROT_ALL, heap);
-    uc_mem_map_ptr(cluster->get_uc(), STACK, STACK_SIZE, UC_PROT_ALL, stack);
-    err = uc_emu_start(cluster->get_uc(), start_pc, 0, 0, instrs);
-    uc_mem_unmap(cluster->get_uc(), STACK, STACK_SIZE);
-    uc_mem_unmap(cluster->get_uc(), HEAP, HEAP_SIZE);
+    engine->map_inst_mem(heap, stack);
+    lock.unlock();
+    err = uc_emu_start(engine->get_uc(), start_pc, 0, 0, instrs);
+    engine->regs_stale();
     regs_invalidate();
     
-    //printf("Instance Id %u: block %llx-%llx, pc %llx, size %llx\n", get_id(), get_current_block(), cluster->blocks[get_current_block()].addr_end, get_pc(), cluster->blocks[get_current_block()].size());
+    // Make the history look like we stepped up to the last instruction ran.
+    // Straight-line code can still move LR and SP (epilogue loads, stack
+    // adjustments), so the entry takes what the slice left them as.
+    bool stepped = instrs <= 1;
+    if (!stepped && !err)
+    {
+        reg_history[0].pc = end_pc - 4;
+        reg_history[0].lr = get_lr();
+        reg_history[0].sp = get_sp();
+    }
+    
+    //printf("Instance Id %u: block %llx-%llx, pc %llx, size %llx\n", get_id(), get_current_block(), cluster->live_block(get_current_block()).addr_end, get_pc(), cluster->live_block(get_current_block()).size());
 
     if (err && !uc_term)
     {
-        if (get_pc() == MAGIC_IMPORT)
-        {
-            err = UC_ERR_OK;
-            set_pc(get_lr());
-
-            pop_block();
-            
-            if (slow && get_pc() > cluster->blocks[get_current_block()].addr_end && get_pc() - cluster->blocks[get_current_block()].addr_end == 4)
-                cluster->blocks[get_current_block()].addr_end = get_pc();
-        }
-        else if (get_pc() == 0 && get_sp() == STACK_END)
+        // Imports return to LR from inside hook_import, so only completion
+        // and genuine faults end up here
+        if (get_pc() == 0 && get_sp() == STACK_END)
         {
             printf_info("Instance Id %u ran to completion.\n", get_id());
             uc_term = true;
@@ -365,7 +684,7 @@ uc_err EmuInstance::uc_run_slice()
         else
         {
             printf_error("Instance Id %u: Failed on uc_emu_start() with error returned: %u: %s\n", get_id(), err, uc_strerror(err));
-            uc_print_regs(cluster->get_uc()); // use struct
+            uc_print_regs(engine->get_uc()); // use struct
             uc_term = true;
             return err;
         }
@@ -373,6 +692,13 @@ uc_err EmuInstance::uc_run_slice()
 
     if (!slow) return err;
 
+    // Only a block's terminating instruction can branch, and it always runs as
+    // a slice of its own. A longer slice moving LR is just code like the
+    // ldp x29, x30 before a ret.
+    if (!stepped) return err;
+
+    lock.lock();
+
     if (get_pc() && get_pc() - start_pc != 4 && get_lr() != start_lr)
     {
         printf_verbose("Instance Id %u: Branch detected PC @ %" PRIx64 ", prev %" PRIx64 " lr %" PRIx64 "\n", get_id(), get_pc(), start_pc, get_lr());
@@ -380,10 +706,10 @@ uc_err EmuInstance::uc_run_slice()
         
         token.pc = get_lr() ? get_lr() - 4 : 0;
         token.fork_hierarchy = get_fork_hierarchy();
-        token.str = "SUB_BRANCH";
+        token.sym = L2C_TokenSym_SubBranch;
         token.type = L2C_TokenType_Branch;
         token.args.push_back(get_pc());
-        if (!cluster->converge_points[token.pc])
+        if (!cluster->is_converge_point(token.pc))
         {
             cluster->add_token_by_prio(get_current_block(), token);
         }
@@ -402,7 +728,7 @@ uc_err EmuInstance::uc_run_slice()
         L2C_Token token;
         token.pc = start_pc;
         token.fork_hierarchy = get_fork_hierarchy();
-        token.str = "SUB_RET";
+        token.sym = L2C_TokenSym_SubRet;
         token.type = L2C_TokenType_Meta;
  
         uint64_t current = get_current_block();
@@ -414,19 +740,65 @@ uc_err EmuInstance::uc_run_slice()
         //token.args.push_back(get_pc());
         cluster->add_token_by_prio(current, token);
         
-        if (start_pc+4 >= cluster->blocks[current].addr_end)
-            cluster->blocks[current].addr_end = start_pc+4;
+        if (start_pc+4 >= cluster->live_block(current).addr_end)
+            cluster->set_block_end(current, start_pc+4);
     }
 
     return err;
 }
 
+// Runs a replayed fork up to and including the branch at target. One which
+// never gets there still has its path emulated, just as a diverged fork.
+void EmuInstance::sync_to(uint64_t target)
+{
+    uc_err err = UC_ERR_OK;
+    for (int i = 0; !err && !is_term(); i++)
+    {
+        if (i >= FORK_SYNC_LIMIT)
+        {
+            printf_error("Instance Id %u: Lost sync with Instance Id %u at %" PRIx64 ", wanted %" PRIx64 ", running it as diverged\n", get_id(), parent_id(), get_pc(), target);
+            set_start_addr(get_pc());
+            break;
+        }
+
+        bool at_target = get_pc() == target;
+        err = uc_run_slice();
+        
+        if (at_target) break;
+    }
+}
+
+uint64_t EmuInstance::slice_end(uint64_t start_pc)
+{
+    uint64_t pc = start_pc;
+
+    while (pc >= NRO && pc < NRO + NRO_SIZE - 4)
+    {
+        if (INSTR_IS_BLOCK_END(*(uint32_t*)uc_ptr_to_real_ptr(pc))) break;
+
+        pc += 4;
+        
+        // Anything which would be checked at the start of a slice has to start one
+        if (pc == end_addr || cluster->is_code_hook(pc)) break;
+
+        auto block = cluster->find_live_block(pc);
+        if (block && block->type != L2C_CodeBlockType_Invalid) break;
+    }
+    
+    if (pc == start_pc)
+        return start_pc + 4;
+    
+    return pc;
+}
+
 uint64_t EmuInstance::execute(uint64_t start, bool run_slow, bool reset_heap_after, uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3)
 {
     uc_err err = UC_ERR_OK;
     uint64_t heap_size_start = heap_size;
     
     uint64_t outval = heap_alloc(0x12);
+    uint64_t slices_start = cluster->get_slices();
+    auto time_start = std::chrono::steady_clock::now();
 
     uc_term = false;
     slow = run_slow;
@@ -447,18 +819,19 @@ uint64_t EmuInstance::execute(uint64_t start, bool run_slow, bool reset_heap_aft
     jump_history.clear();
     block_stack.clear();
     parent = nullptr;
+    update_fork_hierarchy();
     forks.clear();
     outputted_tokens = 0;
     cluster->invalidate_blocktree(this, start);
 
     push_jump(start);
-    cluster->blocks[0] = L2C_CodeBlock();
-    cluster->blocks[start] = L2C_CodeBlock(start, L2C_CodeBlockType_Subroutine, get_fork_hierarchy());
+    cluster->set_block(0, L2C_CodeBlock());
+    cluster->set_block(start, L2C_CodeBlock(start, L2C_CodeBlockType_Subroutine, get_fork_hierarchy().vec()));
     
     block_stack.push_back(0);
     block_stack.push_back(start);
-    cluster->blocks[start].addr = start;
-    cluster->blocks[start].type = get_current_block_type();
+    cluster->live_block(start).addr = start;
+    cluster->live_block(start).type = get_current_block_type();
     start_addr = start;
 
     printf_info("Instance Id %u: Starting emulation of %" PRIx64 "\n", get_id(), start);
@@ -469,7 +842,7 @@ uint64_t EmuInstance::execute(uint64_t start, bool run_slow, bool reset_heap_aft
 
     printf_info("Instance Id %u: Emulation done.\n", get_id());
     printf_verbose("Below is the CPU contexts:\n");
-    uc_print_regs(cluster->get_uc()); //TODO ehhhhh use struct
+    uc_print_regs(engine->get_uc()); //TODO ehhhhh use struct
     
     // Finish fork's work if it exists
     forks_complete();
@@ -488,12 +861,12 @@ uint64_t EmuInstance::execute(uint64_t start, bool run_slow, bool reset_heap_aft
         }
     
         L2C_Token token;
-        token.pc = cluster->blocks[nonreturning].addr_end;
+        token.pc = cluster->live_block(nonreturning).addr_end;
         token.fork_hierarchy = get_fork_hierarchy();
-        token.str = "NORETURN";
+        token.sym = L2C_TokenSym_Noreturn;
         token.type = L2C_TokenType_Meta;
         
-        cluster->blocks[nonreturning].addr_end += 4;
+        cluster->live_block(nonreturning).addr_end += 4;
 
         cluster->add_token_by_prio(nonreturning, token);*/
         is_noreturn = true;
@@ -501,8 +874,11 @@ uint64_t EmuInstance::execute(uint64_t start, bool run_slow, bool reset_heap_aft
     
     // Clean any loose strands and check for oddities
     cluster->clean_and_verify_blocks(start, is_noreturn);
+    cluster->freeze_graph();
     
-    printf_info("Instance Id %u: Emulation of %" PRIx64 " is complete.\n", get_id(), start);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - time_start;
+    uint64_t slices_ran = cluster->get_slices() - slices_start;
+    printf_info("Instance Id %u: Emulation of %" PRIx64 " is complete, %" PRIu64 " slices (%.0f slices/s).\n", get_id(), start, slices_ran, slices_ran / elapsed.count());
 
     if (reset_heap_after)
         heap_size = heap_size_start;
@@ -543,6 +919,16 @@ uint64_t EmuInstance::heap_alloc(uint32_t size)
     return retval;
 }
 
+uint64_t EmuInstance::get_heap_size()
+{
+    return heap_size;
+}
+
+void EmuInstance::set_heap_size(uint64_t size)
+{
+    heap_size = size;
+}
+
 bool EmuInstance::is_term()
 {
     return uc_term;
@@ -599,18 +985,24 @@ bool EmuInstance::has_parent()
     return parent != nullptr;
 }
 
-std::vector<int> EmuInstance::get_fork_hierarchy()
+const L2C_ForkHierarchy& EmuInstance::get_fork_hierarchy()
+{
+    return fork_hierarchy;
+}
+
+// Ids only change at construction and parents only when execute drops one
+void EmuInstance::update_fork_hierarchy()
 {
-    std::vector<int> out;
+    std::vector<int> ids;
  
     EmuInstance* iter = this;
     while(iter)
     {
-        out.push_back(iter->get_id());
+        ids.push_back(iter->get_id());
         iter = iter->parent;
     }
     
-    return out;
+    fork_hierarchy = cluster->intern_hierarchy(ids);
 }
 
 uint64_t EmuInstance::get_jump_history(size_t depth)
@@ -667,7 +1059,7 @@ L2C_CodeBlockType EmuInstance::get_current_block_type()
         return L2C_CodeBlockType_Invalid;
     }
     
-    return cluster->blocks[*(block_stack.end() - 1)].type;
+    return cluster->live_block(*(block_stack.end() - 1)).type;
 }
 
 L2C_CodeBlockType EmuInstance::get_last_block_type()
@@ -680,7 +1072,7 @@ L2C_CodeBlockType EmuInstance::get_last_block_type()
         return L2C_CodeBlockType_Invalid;
     }
 
-    return cluster->blocks[*(block_stack.end() - 2)].type;
+    return cluster->live_block(*(block_stack.end() - 2)).type;
 }
 
 void EmuInstance::push_block(L2C_CodeBlockType type, int backlog)
@@ -690,39 +1082,35 @@ void EmuInstance::push_block(L2C_CodeBlockType type, int backlog)
     uint64_t addr = backlog ? reg_history[backlog-1].pc : get_pc();
     block_stack.push_back(addr);
 
-    L2C_CodeBlock new_block(addr, type, get_fork_hierarchy());
+    L2C_CodeBlock new_block(addr, type, get_fork_hierarchy().vec());
     printf_verbose("Instance Id %u: Push block %" PRIx64 ", type %s\n", get_id(), addr, new_block.typestr().c_str());
     
-    for (auto& block_pair : cluster->blocks)
+    uint64_t conflict = cluster->find_overlapping_block(addr);
+    if (conflict)
     {
-        auto& block = block_pair.second;
-        
-        if (!block.addr) continue;
+        auto& block = cluster->live_block(conflict);
 
-        //printf_verbose("%llx %llx-%llx\n", block_pair.first, block.addr, block.addr_end);
-        
-        if (addr == block.addr)
-        {
-            if (cluster->convergable_block(block.addr, get_fork_hierarchy()))
-            {
-                printf_verbose("Instance Id %u: Block's creator is greater, converging...?\n", get_id());
-                return;
-            }
+        printf_verbose("Instance Id %u: Created block has address conflicts!\n", get_id());
+        printf_verbose("Instance Id %u: Existing, start=%" PRIx64 ", end=%" PRIx64 " Creating start=%" PRIx64 "\n", get_id(), block.addr, block.addr_end, addr);
+        cluster->split_block(block.addr, addr);
+        return;
+    }
 
-            printf_warn("Instance Id %u: Created block %" PRIx64 " resets existing block (prev %s, new %s)...\n", get_id(), addr, block.fork_hierarchy_str().c_str(), new_block.fork_hierarchy_str().c_str());
-            break;
-        }
+    auto existing = cluster->find_live_block(addr);
+    if (addr && existing && existing->addr == addr)
+    {
+        auto& block = *existing;
 
-        if (addr > block.addr && addr < block.addr_end)
+        if (cluster->convergable_block(block.addr, get_fork_hierarchy().vec()))
         {
-            printf_verbose("Instance Id %u: Created block has address conflicts!\n", get_id());
-            printf_verbose("Instance Id %u: Existing, start=%" PRIx64 ", end=%" PRIx64 " Creating start=%" PRIx64 "\n", get_id(), block.addr, block.addr_end, addr);
-            cluster->split_block(block.addr, addr);
+            printf_verbose("Instance Id %u: Block's creator is greater, converging...?\n", get_id());
             return;
         }
+
+        printf_warn("Instance Id %u: Created block %" PRIx64 " resets existing block (prev %s, new %s)...\n", get_id(), addr, block.fork_hierarchy_str().c_str(), new_block.fork_hierarchy_str().c_str());
     }
 
-    cluster->blocks[addr] = new_block;
+    cluster->set_block(addr, new_block);
 }
 
 void EmuInstance::pop_block(bool single)
@@ -760,7 +1148,7 @@ void EmuInstance::print_blockchain()
     int incr = 0;
     for (auto& b : block_stack)
     {
-        printf("%u: addr %" PRIx64 ", type %s\n", incr++, cluster->blocks[b].addr, cluster->blocks[b].typestr().c_str());
+        printf("%u: addr %" PRIx64 ", type %s\n", incr++, cluster->live_block(b).addr, cluster->live_block(b).typestr().c_str());
     }
 }
 
@@ -824,10 +1212,10 @@ void EmuInstance::purge_forks_in_range(uint64_t start, uint64_t end)
 
 void EmuInstance::regs_flush()
 {
-    uc_write_reg_state(cluster->get_uc(), &regs_cur);
+    engine->regs_flush(&regs_cur);
 }
     
 void EmuInstance::regs_invalidate()
 {
-    uc_read_reg_state(cluster->get_uc(), &regs_cur);
+    engine->regs_invalidate(&regs_cur);
 }
@@ -8,17 +8,28 @@
 #include <vector>
 #include <deque>
 #include <map>
+#include <set>
 #include <unordered_set>
 #include "uc_impl.h"
 #include "logging.h"
 
 class ClusterManager;
+class EmuEngine;
 
 #define MAGIC_IMPORT 0xF00F1B015
 #define INSTR_RET 0xD65F03C0
 
+// B/BL, B.cond, CBZ/CBNZ, TBZ/TBNZ, BR/BLR/RET and SVC/BRK all end a basic block
+#define INSTR_IS_BLOCK_END(instr) (((instr) & 0x7C000000) == 0x14000000 \
+                                   || ((instr) & 0xFF000010) == 0x54000000 \
+                                   || ((instr) & 0x7C000000) == 0x34000000 \
+                                   || ((instr) & 0xFE000000) == 0xD6000000 \
+                                   || ((instr) & 0xFF000000) == 0xD4000000)
+
 #define REG_HISTORY_LIMIT 10
 #define JUMP_HISTORY_LIMIT 10
+#define FORK_SYNC_LIMIT 0x10000
+#define COMPARE_BRANCH_SCAN_LIMIT 16
 
 // 1GiB mem
 #define MAX_UC_MEM 0x40000000
@@ -26,16 +37,24 @@ class ClusterManager;
 extern std::atomic<int> uc_insts_active;
 extern std::atomic<uint64_t> uc_memory_use;
 
+void uc_res_wait(int id, uint64_t size);
+void uc_res_wait_room(uint64_t size);
+void uc_res_release(uint64_t size);
+void uc_res_notify();
+
 class EmuInstance
 {
 private:
     ClusterManager* cluster;
+    EmuEngine* engine;
     uc_err err_last;
     void* nro;
     void* imports;
     void* heap;
     uint64_t heap_size = 0;
     void* stack;
+    bool heap_owned = false;
+    uint64_t mem_size = 0;
     
     std::vector<EmuInstance*> forks;
     EmuInstance* parent;
@@ -45,18 +64,36 @@ private:
     uint64_t fork_addr = 0;
     int watching_fork = 0;
     
+    // Where a comparison fork and its parent split: the branch on the result,
+    // and where the false (parent) and true (fork) sides go from it. Zero if
+    // the branch couldn't be found up front and the fork gets replayed.
+    uint64_t div_branch = 0;
+    uint64_t div_false = 0;
+    uint64_t div_true = 0;
+    uint64_t div_fork_addr = 0;
+    bool div_true_side = false;
+    
     bool slow;
     bool uc_term;
     int instance_id;
+    L2C_ForkHierarchy fork_hierarchy;
     
     std::vector<uint64_t> block_stack;
     std::deque<uc_reg_state> reg_history;
     std::deque<uint64_t> jump_history;
+    
+    bool compare_branch(uint64_t pc, uint64_t* branch_pc, uint64_t* if_false, uint64_t* if_true);
+    bool diverge();
+    void update_fork_hierarchy();
 
 public:
     uc_reg_state regs_cur;
     std::vector<L2CValue> lua_stack;
     std::map<uint64_t, L2CValue*> lua_active_vars;
+    
+    // Hash tracing progress, see hook_stack_read and hook_crc_read
+    uint32_t sp_part1 = 0, sp_part2 = 0;
+    std::set<uint32_t> last_crcs;
 
     EmuInstance(ClusterManager* parent_cluster);
     EmuInstance(ClusterManager* parent_cluster, EmuInstance* to_clone, EmuInstance* parent = nullptr);
@@ -67,19 +104,41 @@ public:
         return cluster;
     }
     
+    EmuEngine* get_engine()
+    {
+        return engine;
+    }
+    
+    EmuInstance* get_parent()
+    {
+        return parent;
+    }
+    
     uint64_t get_fork_addr()
     {
         return fork_addr;
     }
     
+    uint64_t get_div_branch()
+    {
+        return div_branch;
+    }
+    
     int cluster_id();
     void forks_complete();
     void fork_inst();
+    std::vector<EmuInstance*> take_forks();
+    void move_to_engine(EmuEngine* to);
+    void own_heap();
     void add_import_hook(uint64_t addr);
     uc_err uc_run_slice();
+    void sync_to(uint64_t target);
+    uint64_t slice_end(uint64_t start_pc);
     uint64_t execute(uint64_t start, bool run_slow, bool reset_heap_after, uint64_t x0 = 0, uint64_t x1 = 0, uint64_t x2 = 0, uint64_t x3 = 0);
     void* uc_ptr_to_real_ptr(uint64_t ptr);
     uint64_t heap_alloc(uint32_t size);
+    uint64_t get_heap_size();
+    void set_heap_size(uint64_t size);
     bool is_term();
     void terminate();
     int get_id();
@@ -91,7 +150,7 @@ public:
     uint64_t get_sp();
     uint64_t get_lr();
     bool has_parent();
-    std::vector<int> get_fork_hierarchy();
+    const L2C_ForkHierarchy& get_fork_hierarchy();
     uint64_t get_jump_history(size_t depth = 0);
     void push_jump(uint64_t addr);
     uint64_t get_current_block();